@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,13 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * breadahead starts reading blocks that will be needed
+//     soon, without waiting for them.
+//
+// Buffers are hashed on (dev, blockno) into NBUCKET buckets,
+// each with its own lock, so lookups of different blocks do
+// not contend. Recycling a buffer picks the unused one that
+// was released longest ago, and is serialized by bcache.lock.
 //
 // The implementation uses two state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
@@ -26,70 +33,161 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;   // List of buffers in this bucket, through prev/next.
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;  // Held while moving a buffer between buckets.
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Create the empty bucket lists, then put every buffer
+  // in the first one; they move when they are recycled.
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    blink(&bcache.bucket[0], b);
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block on device dev in bucket bk, which must be
+// locked. If found, take a reference to it.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head.next; b != &bk->head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer. If ahead is set,
+// return 0 instead of waiting for a block that is cached,
+// or of panicking when no buffer can be recycled.
+static struct buf*
+bget(uint dev, uint blockno, int ahead)
+{
+  struct buf *b, *c, *lru;
+  struct bucket *bk, *lrubk, *p;
+
+  bk = bhash(dev, blockno);
+
+  // Is the block already cached?
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  if(b && ahead)
+    b->refcnt--;
+  release(&bk->lock);
+  if(b){
+    if(ahead)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
 
-  // Not cached; recycle an unused buffer.
+  // Not cached. Only one process at a time recycles buffers,
+  // so check again in case another one just cached the block.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  if(b && ahead)
+    b->refcnt--;
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    if(ahead)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Recycle the unused buffer released longest ago, keeping
+  // the lock of the bucket that holds it.
   // Even if refcnt==0, B_DIRTY indicates a buffer is in use
   // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  lru = 0;
+  lrubk = 0;
+  for(p = bcache.bucket; p < bcache.bucket+NBUCKET; p++){
+    acquire(&p->lock);
+    b = 0;
+    for(c = p->head.next; c != &p->head; c = c->next)
+      if(c->refcnt == 0 && (c->flags & B_DIRTY) == 0 &&
+         (b == 0 || c->lastuse < b->lastuse))
+        b = c;
+    if(b && (lru == 0 || b->lastuse < lru->lastuse)){
+      if(lrubk)
+        release(&lrubk->lock);
+      lru = b;
+      lrubk = p;
+    } else
+      release(&p->lock);
   }
-  panic("bget: no buffers");
+  if(lru == 0){
+    release(&bcache.lock);
+    if(ahead)
+      return 0;
+    panic("bget: no buffers");
+  }
+
+  bunlink(lru);
+  release(&lrubk->lock);
+  lru->dev = dev;
+  lru->blockno = blockno;
+  lru->flags = 0;
+  lru->refcnt = 1;
+  acquire(&bk->lock);
+  blink(bk, lru);
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&lru->lock);
+  return lru;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -98,7 +196,7 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if((b->flags & B_VALID) == 0) {
     iderw(b);
   }
@@ -115,29 +213,89 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
-// Release a locked buffer.
-// Move to the head of the MRU list.
+// Write the contents of the n locked bufs bp[] to disk.
+// They are queued together, so that the disk driver can
+// write neighbouring blocks with one command. bp[n-1] is
+// written last, after all the others, so it can serve as
+// a commit record.
 void
-brelse(struct buf *b)
+bwritev(struct buf **bp, int n)
 {
-  if(!holdingsleep(&b->lock))
-    panic("brelse");
+  int i;
 
-  releasesleep(&b->lock);
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bp[i]->lock))
+      panic("bwritev");
+    bp[i]->flags |= B_DIRTY;
+  }
+  if(n > 1)
+    bp[n-1]->flags |= B_ORDER;
+  idesubmit(bp, n);
+  for(i = 0; i < n; i++)
+    idesync(bp[i]);
+}
 
-  acquire(&bcache.lock);
+// Start reading the n blocks blocks[] of device dev into
+// the cache and return without waiting for them. Blocks that
+// are cached, or on their way, are left alone, and so are
+// all blocks when every buffer is in use. The buffers
+// stay locked until the disk interrupt handler has read them
+// and calls bdone().
+void
+breadahead(uint dev, uint *blocks, int n)
+{
+  struct buf *b, *bp[NRAHEAD];
+  int i, nbp;
+
+  if(n > NRAHEAD)
+    panic("breadahead");
+  nbp = 0;
+  for(i = 0; i < n; i++){
+    if((b = bget(dev, blocks[i], 1)) == 0)
+      continue;
+    b->flags |= B_ASYNC;
+    bp[nbp++] = b;
+  }
+  if(nbp > 0)
+    idesubmit(bp, nbp);
+}
+
+// Drop a reference to b, which is unlocked.
+static void
+bunref(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
+}
+
+// Release a buffer that breadahead() started reading, now
+// that the disk has read it. Called by the disk interrupt
+// handler, in place of the process that locked b.
+void
+bdone(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bunref(b);
+}
+
+// Release a locked buffer.
+// Record when it was last used, for recycling in LRU order.
+void
+brelse(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("brelse");
+
+  releasesleep(&b->lock);
+  bunref(b);
 }
 //PAGEBREAK!
 // Blank page.
@@ -4,11 +4,14 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks at last release, for LRU recycling
+  struct buf *prev; // hash bucket list
   struct buf *next;
   struct buf *qnext; // disk queue
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ORDER 0x8  // disk must finish earlier requests first
+#define B_ASYNC 0x10 // read ahead; disk interrupt releases buffer
 
@@ -0,0 +1,82 @@
+// Measure context switches per second.
+//
+// Each pair of processes bounces one byte back and forth over
+// two pipes, so every round trip is two blocking reads and
+// two context switches. Run with 1, 2, 4, ... pairs and with
+// different CPUS= settings to see how switching scales with
+// the number of CPUs:
+//    $ cswbench 4
+// The timer ticks about 100 times per second.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define ROUNDS 2000
+#define TICKS_PER_SEC 100
+
+void
+pingpong(int in, int out, int first)
+{
+  char c = 0;
+  int i;
+
+  for(i = 0; i < ROUNDS; i++){
+    if(first && write(out, &c, 1) != 1)
+      break;
+    if(read(in, &c, 1) != 1)
+      break;
+    if(!first && write(out, &c, 1) != 1)
+      break;
+  }
+}
+
+int
+run(int npairs)
+{
+  int i, start, elapsed, ab[2], ba[2];
+
+  start = uptime();
+  for(i = 0; i < npairs; i++){
+    if(pipe(ab) < 0 || pipe(ba) < 0){
+      printf(2, "cswbench: pipe failed\n");
+      exit();
+    }
+    if(fork() == 0){
+      pingpong(ba[0], ab[1], 1);
+      exit();
+    }
+    if(fork() == 0){
+      pingpong(ab[0], ba[1], 0);
+      exit();
+    }
+    close(ab[0]);
+    close(ab[1]);
+    close(ba[0]);
+    close(ba[1]);
+  }
+  for(i = 0; i < 2*npairs; i++)
+    wait();
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+  return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int npairs, maxpairs, ticks, switches;
+
+  maxpairs = argc > 1 ? atoi(argv[1]) : 4;
+  if(maxpairs < 1)
+    maxpairs = 1;
+
+  for(npairs = 1; npairs <= maxpairs; npairs *= 2){
+    ticks = run(npairs);
+    switches = 2 * ROUNDS * npairs;
+    printf(1, "%d pairs: %d switches in %d ticks, %d switches/s\n",
+           npairs, switches, ticks, switches * TICKS_PER_SEC / ticks);
+  }
+  exit();
+}
@@ -4,17 +4,23 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct pstat;
+struct rastate;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vmseg;
 
 // bio.c
+void            bdone(struct buf*);
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint*, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
 
 // console.c
 void            consoleinit(void);
@@ -36,6 +42,7 @@ int             filewrite(struct file*, char*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            dcinval(struct inode*, char*);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
@@ -49,7 +56,7 @@ void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
-int             readi(struct inode*, char*, uint, uint);
+int             readi(struct inode*, char*, uint, uint, struct rastate*);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
@@ -57,6 +64,8 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf**, int);
+void            idesync(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -68,6 +77,8 @@ char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kincref(char*);
+int             krefcount(char*);
 
 // kbd.c
 void            kbdintr(void);
@@ -106,15 +117,19 @@ int             pipewrite(struct pipe*, char*, int);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             getpinfo(struct pstat*);
 int             growproc(int);
 int             kill(int);
+void            mlfqboost(void);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             schedtick(void);
 void            setproc(struct proc*);
+int             settickets(int);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(void);
@@ -151,6 +166,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argoutptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -185,6 +201,15 @@ void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+int             cowfault(pde_t*, uint);
+uint            pageloan(pde_t*, uint);
+int             pageflip(pde_t*, uint, uint);
+int             lazyfault(struct proc*, uint);
+int             pagein(struct proc*, uint);
+int             pageinrange(struct proc*, uint, uint, int);
+void            dupsegs(struct vmseg*, struct vmseg*);
+void            putsegs(struct vmseg*);
+void            trimsegs(struct vmseg*, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -18,6 +18,11 @@ exec(char *path, char **argv)
   struct proghdr ph;
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
+  struct vmseg segs[NSEG];
+  int nseg;
+
+  memset(segs, 0, sizeof(segs));
+  nseg = 0;
 
   begin_op();
 
@@ -30,7 +35,7 @@ exec(char *path, char **argv)
   pgdir = 0;
 
   // Check ELF header
-  if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
+  if(readi(ip, (char*)&elf, 0, sizeof(elf), 0) != sizeof(elf))
     goto bad;
   if(elf.magic != ELF_MAGIC)
     goto bad;
@@ -41,7 +46,7 @@ exec(char *path, char **argv)
   // Load program into memory.
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
-    if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
+    if(readi(ip, (char*)&ph, off, sizeof(ph), 0) != sizeof(ph))
       goto bad;
     if(ph.type != ELF_PROG_LOAD)
       continue;
@@ -49,10 +54,25 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(nseg < NSEG){
+      // Only record where the segment comes from; its pages
+      // are read on first touch (see pagein in vm.c).
+      if(ph.vaddr + ph.memsz >= KERNBASE)
+        goto bad;
+      segs[nseg].ip = idup(ip);
+      segs[nseg].va = ph.vaddr;
+      segs[nseg].memsz = ph.memsz;
+      segs[nseg].off = ph.off;
+      segs[nseg].filesz = ph.filesz;
+      nseg++;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
+    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+      goto bad;
     if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
@@ -101,13 +121,24 @@ exec(char *path, char **argv)
   curproc->tf->esp = sp;
   switchuvm(curproc);
   freevm(oldpgdir);
+  begin_op();
+  putsegs(curproc->segs);
+  end_op();
+  memmove(curproc->segs, segs, sizeof(segs));
   return 0;
 
  bad:
   if(pgdir)
     freevm(pgdir);
   if(ip){
-    iunlockput(ip);
+    // iput() locks the inode, so unlock it before dropping segments
+    iunlock(ip);
+    putsegs(segs);
+    iput(ip);
+    end_op();
+  } else if(nseg > 0){
+    begin_op();
+    putsegs(segs);
     end_op();
   }
   return -1;
@@ -14,6 +14,7 @@ struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
   struct file file[NFILE];
+  char name[NFILE][FNAMESZ];   // Name of each file, empty when unused
 } ftable;
 
 void
@@ -32,6 +33,10 @@ filealloc(void)
   for(f = ftable.file; f < ftable.file + NFILE; f++){
     if(f->ref == 0){
       f->ref = 1;
+      f->name = ftable.name[f - ftable.file];
+      f->ra.last = -1;
+      f->ra.next = 0;
+      f->ra.win = 0;
       release(&ftable.lock);
       return f;
     }
@@ -68,6 +73,7 @@ fileclose(struct file *f)
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  f->name[0] = 0;
   release(&ftable.lock);
 
   if(ff.type == FD_PIPE)
@@ -103,8 +109,11 @@ fileread(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
+    // Copy shared pages of addr before readi writes to them
+    if(pageinrange(myproc(), (uint)addr, n, 1) < 0)
+      return -1;
     ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, addr, f->off, n, &f->ra)) > 0)
       f->off += r;
     iunlock(f->ip);
     return r;
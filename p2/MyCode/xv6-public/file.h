@@ -1,3 +1,10 @@
+// Sequential readahead state of an open file (see readahead in fs.c).
+struct rastate {
+  uint last;          // last block read
+  uint next;          // first block not yet read ahead
+  uint win;           // blocks to read ahead of last
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE } type;
   int ref; // reference count
@@ -6,7 +13,8 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
-  char *name;
+  char *name;     // path it was opened with, in ftable.name
+  struct rastate ra;
 };
 
 
@@ -23,6 +23,8 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void dcinit(void);
+static void dcpurge(struct inode*);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -178,6 +180,8 @@ iinit(int dev)
     initsleeplock(&icache.inode[i].lock, "inode");
   }
 
+  dcinit();
+
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
@@ -339,6 +343,8 @@ iput(struct inode *ip)
     if(r == 1){
       // inode has no links and no other references: truncate and free.
       itrunc(ip);
+      if(ip->type == T_DIR)
+        dcpurge(ip);
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
@@ -446,11 +452,58 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential readahead.
+// Each open file keeps track of the last block read through
+// it in ra, so that processes reading one inode at different
+// offsets do not disturb each other. While reads go on where
+// the last one stopped, readi() doubles the number of blocks
+// it reads ahead of them, up to NRAHEAD, and starts reading
+// them into the buffer cache without waiting, so that the
+// disk works while the process handles the data. A jump
+// elsewhere in the file ends the readahead. The blocks of one
+// read are queued together as well, so that the disk reads
+// them in one command; that is all a read without ra gets.
+static void
+readahead(struct inode *ip, struct rastate *ra, uint first, uint last)
+{
+  uint blocks[NRAHEAD], bn, end;
+  int n;
+
+  bn = first;
+  end = last;
+  if(ra){
+    if(first == ra->last || first == ra->last + 1){
+      if(ra->win == 0)
+        ra->win = 2;
+      else if(ra->win < NRAHEAD)
+        ra->win *= 2;
+    } else {
+      ra->win = 0;
+      ra->next = 0;
+    }
+    ra->last = last;
+    end = last + ra->win;
+    if(ra->next > first)
+      bn = ra->next;
+  }
+
+  if(end >= (ip->size + BSIZE - 1) / BSIZE)
+    end = (ip->size + BSIZE - 1) / BSIZE - 1;
+  n = 0;
+  for(; bn <= end && n < NRAHEAD; bn++)
+    blocks[n++] = bmap(ip, bn);
+  if(ra)
+    ra->next = bn;
+  if(n > 1 || (n == 1 && bn - 1 > last))
+    breadahead(ip->dev, blocks, n);
+}
+
 //PAGEBREAK!
-// Read data from inode.
+// Read data from inode, reading ahead with the state ra of
+// the open file it is read through, if any.
 // Caller must hold ip->lock.
 int
-readi(struct inode *ip, char *dst, uint off, uint n)
+readi(struct inode *ip, char *dst, uint off, uint n, struct rastate *ra)
 {
   uint tot, m;
   struct buf *bp;
@@ -465,6 +518,8 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, ra, off/BSIZE, (off+n-1)/BSIZE);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -519,8 +574,134 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entry cache.
+//
+// Remembers the results of recent dirlookup()s, keyed on
+// (directory, name), so that walking a path does not read
+// through whole directories every time. Names that were not
+// found are cached too, as negative entries with inum 0.
+// Entries are hashed into NDBUCKET buckets of NDWAY each,
+// and a bucket recycles its least recently used entry.
+//
+// Entries of a directory are only read or changed while
+// holding the directory's lock, like the directory itself.
+// dirlink() and unlink update the entry of the name they
+// change, and freeing a directory drops all of its entries,
+// since its inode number may be reused. dcache.lock only
+// protects the table.
+
+#define NDBUCKET 16
+#define NDWAY     4
+
+struct dentry {
+  uint dev;
+  uint dir;            // Inode number of the directory, 0 if unused
+  char name[DIRSIZ];
+  uint inum;           // 0 if name is not in the directory
+  uint off;            // Byte offset of the entry in the directory
+  uint lastuse;        // For LRU within the bucket
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDBUCKET][NDWAY];
+  uint clock;
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+// Return the bucket of name in directory dp.
+static struct dentry*
+dchash(struct inode *dp, char *name)
+{
+  uint h;
+  int i;
+
+  h = dp->dev * 31 + dp->inum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return dcache.dentry[h % NDBUCKET];
+}
+
+// Look name up in the cache of directory dp.
+// Returns 1 and sets *pinum and *poff if there is an entry.
+static int
+dcget(struct inode *dp, char *name, uint *pinum, uint *poff)
+{
+  struct dentry *d, *bucket;
+
+  bucket = dchash(dp, name);
+  acquire(&dcache.lock);
+  for(d = bucket; d < bucket + NDWAY; d++){
+    if(d->dir == dp->inum && d->dev == dp->dev &&
+       namecmp(d->name, name) == 0){
+      d->lastuse = ++dcache.clock;
+      *pinum = d->inum;
+      *poff = d->off;
+      release(&dcache.lock);
+      return 1;
+    }
+  }
+  release(&dcache.lock);
+  return 0;
+}
+
+// Record that name is at offset off of directory dp and
+// refers to inum, or that it is missing if inum is 0.
+static void
+dcput(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d, *bucket, *victim;
+
+  bucket = dchash(dp, name);
+  victim = bucket;
+  acquire(&dcache.lock);
+  for(d = bucket; d < bucket + NDWAY; d++){
+    if(d->dir == dp->inum && d->dev == dp->dev &&
+       namecmp(d->name, name) == 0){
+      victim = d;
+      break;
+    }
+    if(victim->dir != 0 && (d->dir == 0 || d->lastuse < victim->lastuse))
+      victim = d;
+  }
+  victim->dev = dp->dev;
+  victim->dir = dp->inum;
+  strncpy(victim->name, name, DIRSIZ);
+  victim->inum = inum;
+  victim->off = off;
+  victim->lastuse = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Forget that name is in directory dp, after removing it.
+// Caller holds dp's lock.
+void
+dcinval(struct inode *dp, char *name)
+{
+  dcput(dp, name, 0, 0);
+}
+
+// Drop every entry of directory dp, which is being freed.
+static void
+dcpurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = &dcache.dentry[0][0]; d < &dcache.dentry[0][0] + NDBUCKET*NDWAY; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev)
+      d->dir = 0;
+  release(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Caller must hold dp's lock.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -530,8 +711,16 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcget(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+    if(readi(dp, (char*)&de, off, sizeof(de), 0) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
       continue;
@@ -540,10 +729,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcput(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcput(dp, name, 0, 0);
   return 0;
 }
 
@@ -563,7 +754,7 @@ dirlink(struct inode *dp, char *name, uint inum)
 
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+    if(readi(dp, (char*)&de, off, sizeof(de), 0) != sizeof(de))
       panic("dirlink read");
     if(de.inum == 0)
       break;
@@ -573,6 +764,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcput(dp, name, inum, off);
 
   return 0;
 }
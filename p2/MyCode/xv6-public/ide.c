@@ -17,6 +17,7 @@
 #define IDE_BSY       0x80
 #define IDE_DRDY      0x40
 #define IDE_DF        0x20
+#define IDE_DRQ       0x08
 #define IDE_ERR       0x01
 
 #define IDE_CMD_READ  0x20
@@ -24,12 +25,31 @@
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
 
+#define IDE_MAXSECT   128   // sectors per disk command
+
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
 // You must hold idelock while manipulating queue.
+//
+// One disk command covers the run of idenbuf buffers at the
+// head of the queue that follow each other on disk and are
+// all read or all written, so that neighbouring blocks take
+// one command; idenbuf is 0 while the disk is idle. The disk
+// interrupts once per sector; idexfer counts the sectors done
+// so far.
+//
+// Waiting requests are kept in C-SCAN order: ascending block
+// numbers from idepos, where the last command ended, then
+// from the start of the disk again. This keeps seeks short,
+// sorts neighbouring blocks next to each other, and serves
+// every block within one sweep. A buf marked B_ORDER is not
+// passed by requests queued after it.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int idenbuf;
+static int idexfer;
+static uint idepos;
 
 static int havedisk1;
 static void idestart(struct buf*);
@@ -69,33 +89,52 @@ ideinit(void)
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Can the disk command for a run ending with buf a go on
+// with buf c?
+static int
+contiguous(struct buf *a, struct buf *c)
+{
+  return c != 0 && c->dev == a->dev && c->blockno == a->blockno + 1 &&
+         (c->flags & B_DIRTY) == (a->flags & B_DIRTY);
+}
+
+// Start the request for b and the buffers after it that
+// continue it on disk.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *e;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
   if (sector_per_block > 7) panic("idestart");
 
+  idenbuf = 1;
+  for(e = b; (idenbuf+1)*sector_per_block <= IDE_MAXSECT &&
+             contiguous(e, e->qnext); e = e->qnext)
+    idenbuf++;
+  if(e->blockno >= FSSIZE)
+    panic("incorrect blockno");
+  idexfer = 0;
+  idepos = e->blockno + 1;
+
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, idenbuf*sector_per_block);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    outb(0x1f7, IDE_CMD_WRITE);
+    while((inb(0x1f7) & (IDE_BSY|IDE_DRQ)) != IDE_DRQ)
+      ;
+    outsl(0x1f0, b->data, SECTOR_SIZE/4);
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, IDE_CMD_READ);
   }
 }
 
@@ -104,24 +143,56 @@ void
 ideintr(void)
 {
   struct buf *b;
+  int i, sector_per_block = BSIZE/SECTOR_SIZE;
 
-  // First queued buffer is the active request.
+  // The run at the head of the queue is the active request.
   acquire(&idelock);
 
   if((b = idequeue) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  // Move the sector this interrupt is for, and return if
+  // the command has more to go.
+  for(i = 0; i < idexfer / sector_per_block; i++)
+    b = b->qnext;
+  if(b->flags & B_DIRTY){
+    // Sector idexfer is on disk; send the next one.
+    idewait(1);
+    if(++idexfer < idenbuf*sector_per_block){
+      if(idexfer % sector_per_block == 0)
+        b = b->qnext;
+      outsl(0x1f0, b->data + (idexfer % sector_per_block)*SECTOR_SIZE,
+            SECTOR_SIZE/4);
+      release(&idelock);
+      return;
+    }
+  } else {
+    // Sector idexfer is ready to be read.
+    if(idewait(1) >= 0)
+      insl(0x1f0, b->data + (idexfer % sector_per_block)*SECTOR_SIZE,
+           SECTOR_SIZE/4);
+    if(++idexfer < idenbuf*sector_per_block){
+      release(&idelock);
+      return;
+    }
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for the bufs of the run, and
+  // release the ones that were read ahead.
+  for(i = 0; i < idenbuf; i++){
+    b = idequeue;
+    idequeue = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~(B_DIRTY|B_ORDER);
+    wakeup(b);
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    }
+  }
+  idenbuf = 0;
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
@@ -137,32 +208,75 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
+  idesubmit(&b, 1);
+  idesync(b);
+}
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+// Insert b into idequeue at its place in the sweep.
+// Caller must hold idelock.
+static void
+ideinsert(struct buf *b)
+{
+  struct buf **pp, **start;
+  int i;
+
+  // Skip the run the disk is working on, and every request
+  // that must go before a B_ORDER buf.
+  start = &idequeue;
+  for(i = 0, pp = &idequeue; *pp; i++, pp = &(*pp)->qnext)
+    if(i < idenbuf || ((*pp)->flags & B_ORDER))
+      start = &(*pp)->qnext;
+  if(b->flags & B_ORDER){
+    b->qnext = 0;
+    *pp = b;
+    return;
+  }
+  for(pp = start; *pp; pp = &(*pp)->qnext)
+    if((*pp)->blockno - idepos > b->blockno - idepos)
+      break;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// Queue the n locked bufs bp[] for the disk and return
+// without waiting for them; see idesync().
+void
+idesubmit(struct buf **bp, int n)
+{
+  struct buf *b;
+  int i, idle;
+
+  for(i = 0; i < n; i++){
+    b = bp[i];
+    if(!holdingsleep(&b->lock))
+      panic("iderw: buf not locked");
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(b->dev != 0 && !havedisk1)
+      panic("iderw: ide disk 1 not present");
+  }
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  // Add bp[] to idequeue.
+  idle = idenbuf == 0;
+  for(i = 0; i < n; i++)  //DOC:insert-queue
+    ideinsert(bp[i]);
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(idle && idequeue)
+    idestart(idequeue);
+
+  release(&idelock);
+}
 
-  // Wait for request to finish.
+// Wait for the request for b, queued by idesubmit(), to finish.
+void
+idesync(struct buf *b)
+{
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
-
-
   release(&idelock);
 }
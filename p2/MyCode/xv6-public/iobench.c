@@ -0,0 +1,115 @@
+// Measure file system read throughput with concurrent readers.
+//
+// Each reader gets its own file of FILEBLOCKS blocks. The files
+// are first read one after the other, which the disk sees as
+// sequential reads, then all at the same time, which makes the
+// disk jump between the files as it would for random reads.
+// The files together are larger than the buffer cache, so most
+// reads go to the disk. Run with up to MAXREADERS readers:
+//    $ iobench 4
+// The timer ticks about 100 times per second.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define BSIZE 512
+#define FILEBLOCKS 128
+#define MAXREADERS 4
+#define TICKS_PER_SEC 100
+
+char buf[BSIZE];
+
+void
+name(char *path, int i)
+{
+  strcpy(path, "iobench.0");
+  path[8] = '0' + i;
+}
+
+void
+makefiles(int n)
+{
+  char path[16];
+  int i, b, fd;
+
+  for(i = 0; i < n; i++){
+    name(path, i);
+    if((fd = open(path, O_CREATE|O_RDWR)) < 0){
+      printf(2, "iobench: cannot create %s\n", path);
+      exit();
+    }
+    for(b = 0; b < FILEBLOCKS; b++){
+      buf[0] = b;
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf(2, "iobench: write failed, disk full?\n");
+        exit();
+      }
+    }
+    close(fd);
+  }
+}
+
+void
+readfile(int i)
+{
+  char path[16];
+  int fd;
+
+  name(path, i);
+  if((fd = open(path, O_RDONLY)) < 0)
+    exit();
+  while(read(fd, buf, BSIZE) == BSIZE)
+    ;
+  close(fd);
+}
+
+// Read the files of n readers, all at once if concurrent,
+// and return the ticks it took.
+int
+run(int n, int concurrent)
+{
+  int i, start, elapsed;
+
+  start = uptime();
+  for(i = 0; i < n; i++){
+    if(fork() == 0){
+      readfile(i);
+      exit();
+    }
+    if(!concurrent)
+      wait();
+  }
+  if(concurrent)
+    for(i = 0; i < n; i++)
+      wait();
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+  return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char path[16];
+  int i, n, kb, seq, conc;
+
+  n = argc > 1 ? atoi(argv[1]) : MAXREADERS;
+  if(n < 1 || n > MAXREADERS)
+    n = MAXREADERS;
+
+  makefiles(n);
+  kb = n * FILEBLOCKS * BSIZE / 1024;
+  seq = run(n, 0);
+  conc = run(n, 1);
+  printf(1, "%d readers, %d KB: one at a time %d ticks, %d KB/s; "
+         "concurrent %d ticks, %d KB/s\n",
+         n, kb, seq, kb * TICKS_PER_SEC / seq, conc, kb * TICKS_PER_SEC / conc);
+  for(i = 0; i < n; i++){
+    name(path, i);
+    unlink(path);
+  }
+  exit();
+}
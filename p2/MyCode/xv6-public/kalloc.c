@@ -17,10 +17,23 @@ struct run {
   struct run *next;
 };
 
+// Free pages cached by one CPU, so that kalloc() and kfree()
+// usually take only that CPU's lock.
+struct kcpu {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+};
+
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run *freelist;        // Global pool, refills the CPU lists
+  struct kcpu cpus[NCPU];
+  // Number of page tables mapping each physical page.
+  // Pages shared copy-on-write after fork() have more than one.
+  // Updated with atomic instructions rather than under a lock.
+  ushort ref[PHYSTOP/PGSIZE];
 } kmem;
 
 // Initialization happens in two phases.
@@ -28,10 +41,16 @@ struct {
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Until then only the global pool is used, since cpuid() does not
+// work before mpinit().
 void
 kinit1(void *vstart, void *vend)
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpus[i].lock, "kmemcpu");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -48,32 +67,113 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    kmem.ref[V2P(p)/PGSIZE] = 1;
     kfree(p);
+  }
 }
+
+// Take up to KBATCH free pages for the list of CPU kc: from
+// the global pool if it has any, otherwise steal half of the
+// list of another CPU. Returns the pages as a chain and their
+// number in *n. The caller must not hold kc->lock, so that two
+// CPUs stealing from each other cannot deadlock.
+static struct run*
+kgrab(struct kcpu *kc, int *n)
+{
+  struct run *head, *r;
+  struct kcpu *victim;
+  int want;
+
+  head = 0;
+  *n = 0;
+  acquire(&kmem.lock);
+  while(*n < KBATCH && (r = kmem.freelist) != 0){
+    kmem.freelist = r->next;
+    r->next = head;
+    head = r;
+    (*n)++;
+  }
+  release(&kmem.lock);
+
+  for(victim = kmem.cpus; head == 0 && victim < &kmem.cpus[NCPU]; victim++){
+    if(victim == kc)
+      continue;
+    acquire(&victim->lock);
+    want = (victim->nfree + 1) / 2;
+    while(*n < want && (r = victim->freelist) != 0){
+      victim->freelist = r->next;
+      victim->nfree--;
+      r->next = head;
+      head = r;
+      (*n)++;
+    }
+    release(&victim->lock);
+  }
+  return head;
+}
+
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct run *r, *spill;
+  struct kcpu *kc;
+  int i;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  if(kmem.ref[V2P(v)/PGSIZE] < 1)
+    panic("kfree ref");
+  if(__sync_sub_and_fetch(&kmem.ref[V2P(v)/PGSIZE], 1) > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    return;
+  }
+
+  // Free to this CPU's list; if it has grown long, hand a
+  // batch back to the global pool for other CPUs.
+  spill = 0;
+  pushcli();
+  kc = &kmem.cpus[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  if(kc->nfree > 2*KBATCH){
+    for(i = 0; i < KBATCH; i++){
+      r = kc->freelist;
+      kc->freelist = r->next;
+      r->next = spill;
+      spill = r;
+    }
+    kc->nfree -= KBATCH;
+  }
+  release(&kc->lock);
+  popcli();
+
+  if(spill){
+    acquire(&kmem.lock);
+    while((r = spill) != 0){
+      spill = r->next;
+      r->next = kmem.freelist;
+      kmem.freelist = r;
+    }
     release(&kmem.lock);
+  }
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -82,15 +182,60 @@ kfree(char *v)
 char*
 kalloc(void)
 {
-  struct run *r;
+  struct run *r, *batch;
+  struct kcpu *kc;
+  int n;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r)
+      kmem.freelist = r->next;
+  } else {
+    // Interrupts stay off so that this process keeps
+    // running on the same CPU while it refills the list.
+    pushcli();
+    kc = &kmem.cpus[cpuid()];
+    acquire(&kc->lock);
+    if(kc->freelist == 0){
+      release(&kc->lock);
+      batch = kgrab(kc, &n);
+      acquire(&kc->lock);
+      while((r = batch) != 0){
+        batch = r->next;
+        r->next = kc->freelist;
+        kc->freelist = r;
+      }
+      kc->nfree += n;
+    }
+    r = kc->freelist;
+    if(r){
+      kc->freelist = r->next;
+      kc->nfree--;
+    }
+    release(&kc->lock);
+    popcli();
+  }
   if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+    kmem.ref[V2P((char*)r)/PGSIZE] = 1;
   return (char*)r;
 }
 
+// Add a reference to an allocated page, for a page table
+// that now shares it.
+void
+kincref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kincref");
+
+  if(kmem.ref[V2P(v)/PGSIZE] < 1)
+    panic("kincref ref");
+  __sync_add_and_fetch(&kmem.ref[V2P(v)/PGSIZE], 1);
+}
+
+// Return the number of references to an allocated page.
+int
+krefcount(char *v)
+{
+  return kmem.ref[V2P(v)/PGSIZE];
+}
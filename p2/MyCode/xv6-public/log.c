@@ -1,6 +1,8 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -19,6 +21,13 @@
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
+// Each call reserves room for MAXOPBLOCKS blocks, and gives
+// back a block of the reservation every time it logs a new
+// one, so that the reservations only cover blocks that
+// in-progress calls might still add.
+// Before committing, the last end_op() yields the CPU once,
+// so that processes about to start FS system calls can
+// join the transaction and share the commit (group commit).
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -27,7 +36,10 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A commit queues all the blocks of each step (log blocks;
+// home locations and then the header that erases the log)
+// with the disk at once, which writes the log blocks in one
+// command, and waits for the step to finish.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,8 +54,10 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int reserved;    // blocks in-progress FS sys calls may still log.
   int dev;
   struct logheader lh;
+  struct buf *bp[LOGSIZE+1]; // blocks being written by commit()
 };
 struct log log;
 
@@ -61,24 +75,48 @@ initlog(int dev)
   readsb(dev, &sb);
   log.start = sb.logstart;
   log.size = sb.nlog;
+  if (log.size - 1 > LOGSIZE)
+    panic("initlog: log too big");
   log.dev = dev;
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Write log.bp[0..n) to disk and release them.
 static void
-install_trans(void)
+flush(int n)
 {
-  int tail;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
+  bwritev(log.bp, n);
+  for (i = 0; i < n; i++)
+    brelse(log.bp[i]);
+}
+
+static struct buf *fill_head(void);
+
+// Copy committed blocks from log to their home location, then
+// erase the transaction from the log. During recovery the
+// blocks come from the log; after a commit, the cached home
+// blocks hold the same data already. The header goes last in
+// the same batch, so it reaches the disk after the blocks.
+static void
+install_trans(int recovering)
+{
+  int tail, n;
+
+  n = log.lh.n;
+  for (tail = 0; tail < n; tail++) {
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+    if (recovering) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    log.bp[tail] = dbuf;
   }
+  log.lh.n = 0;
+  log.bp[n] = fill_head();
+  flush(n+1);
 }
 
 // Read the log header from disk into the in-memory log header
@@ -95,11 +133,10 @@ read_head(void)
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Copy the in-memory log header into the header block,
+// and return the block locked.
+static struct buf*
+fill_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
@@ -108,17 +145,24 @@ write_head(void)
   for (i = 0; i < log.lh.n; i++) {
     hb->block[i] = log.lh.block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+  return buf;
+}
+
+// Write in-memory log header to disk.
+// This is the true point at which the
+// current transaction commits.
+static void
+write_head(void)
+{
+  log.bp[0] = fill_head();
+  flush(1);
 }
 
 static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  install_trans(1); // if committed, copy from log to disk; clear the log
 }
 
 // called at the start of each FS system call.
@@ -129,11 +173,13 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + MAXOPBLOCKS > log.size - 1){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += MAXOPBLOCKS;
+      myproc()->logleft = MAXOPBLOCKS;
       release(&log.lock);
       break;
     }
@@ -149,15 +195,23 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= myproc()->logleft;
+  myproc()->logleft = 0;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.outstanding == 0 && log.lh.n > 0){
+    // Let other processes start FS system calls that join
+    // this transaction. If one did, its end_op() commits.
+    release(&log.lock);
+    yield();
+    acquire(&log.lock);
+  }
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // and this call's unused reservation is free now.
     wakeup(&log);
   }
   release(&log.lock);
@@ -183,21 +237,20 @@ write_log(void)
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
     brelse(from);
-    brelse(to);
+    log.bp[tail] = to;
   }
+  flush(log.lh.n);  // write the log
 }
 
 static void
 commit()
 {
   if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    write_log();      // Write modified blocks from cache to log
+    write_head();     // Write header to disk -- the real commit
+    install_trans(0); // Now install writes to home locations
+                      // and erase the transaction from the log
   }
 }
 
@@ -226,8 +279,13 @@ log_write(struct buf *b)
       break;
   }
   log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
+  if (i == log.lh.n) {
     log.lh.n++;
+    if (myproc()->logleft > 0) {
+      myproc()->logleft--;
+      log.reserved--;
+    }
+  }
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
@@ -95,6 +95,12 @@ struct segdesc {
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
 #define PTE_PS          0x080   // Page Size
+#define PTE_COW         0x200   // Copy-on-write (software-defined bit)
+
+// Page fault error code bits, pushed by the processor as tf->err.
+#define FEC_PR          0x001   // Fault caused by a protection violation
+#define FEC_WR          0x002   // Fault caused by a write
+#define FEC_U           0x004   // Fault occurred in user mode
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -3,12 +3,24 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
+#define FNAMESZ     256  // longest path getfilename() reports, with the NUL
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NSEG          4  // demand-paged program segments per process
+#define KBATCH       32  // free pages moved at a time to or from a CPU's list
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*12)  // max data blocks in on-disk log
+#define NBUF         (LOGSIZE*2+MAXOPBLOCKS*2)  // size of disk block cache
+#define NRAHEAD      16  // max blocks read ahead at once
+#define FSSIZE       2000  // size of file system in blocks
+#define NMLFQ         4  // priority levels of the MLFQ scheduler
+#define BOOSTTICKS  100  // ticks between MLFQ priority boosts
+
+// Scheduling policy, chosen with SCHED= in the Makefile:
+// SCHED_MLFQ (the default), SCHED_STRIDE or SCHED_LOTTERY.
+#if !defined(SCHED_STRIDE) && !defined(SCHED_LOTTERY)
+#define SCHED_MLFQ
+#endif
 
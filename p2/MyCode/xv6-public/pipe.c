@@ -1,6 +1,7 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
 #include "fs.h"
@@ -8,15 +9,39 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// The data of a pipe is a ring buffer of its own page.
+// Readers and writers copy as much as fits in one go, and
+// only call wakeup() when someone sleeps on the other end;
+// a waiting writer is only woken once there is room for at
+// least PIPEWAKE bytes, or the pipe is empty, so that it
+// does not run again for a few bytes at a time.
+//
+// Whole, page-aligned pages of a large write are not copied
+// at all: the writer lends them copy-on-write (pageloan) and
+// they queue up in page[]; a reader whose buffer is page
+// aligned as well gets them mapped in its place (pageflip).
+// To keep the bytes in order, pages are only queued while
+// the ring is empty, and the ring is only written to while
+// no pages are queued.
+#define PIPESIZE PGSIZE
+#define PIPEWAKE (PIPESIZE/2)
+#define NPIPEPAGE 8
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // PIPESIZE bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rsleep;     // number of readers sleeping on nread
+  int wsleep;     // number of writers sleeping on nwrite
+  uint page[NPIPEPAGE];  // physical addresses of lent pages
+  uint pgread;    // number of pages read
+  uint pgwrite;   // number of pages written
+  uint pgoff;     // bytes read of page[pgread] so far
 };
 
 int
@@ -30,10 +55,17 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((p = (struct pipe*)kalloc()) == 0)
     goto bad;
+  if((p->data = kalloc()) == 0)
+    goto bad;
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
   p->nread = 0;
+  p->rsleep = 0;
+  p->wsleep = 0;
+  p->pgread = 0;
+  p->pgwrite = 0;
+  p->pgoff = 0;
   initlock(&p->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,8 +79,11 @@ pipealloc(struct file **f0, struct file **f1)
 
 //PAGEBREAK: 20
  bad:
-  if(p)
+  if(p){
+    if(p->data)
+      kfree(p->data);
     kfree((char*)p);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -69,6 +104,9 @@ pipeclose(struct pipe *p, int writable)
   }
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
+    while(p->pgread != p->pgwrite)
+      kfree(P2V(p->page[p->pgread++ % NPIPEPAGE]));
+    kfree(p->data);
     kfree((char*)p);
   } else
     release(&p->lock);
@@ -79,43 +117,116 @@ int
 pipewrite(struct pipe *p, char *addr, int n)
 {
   int i;
+  uint m, pa;
 
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
+  for(i = 0; i < n; i += m){
+    pa = 0;
+    if((uint)(addr + i) % PGSIZE == 0 && n - i >= PGSIZE)
+      pa = pageloan(myproc()->pgdir, (uint)(addr + i));
+    while(pa ? p->nwrite != p->nread || p->pgwrite == p->pgread + NPIPEPAGE
+             : p->pgwrite != p->pgread || p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
       if(p->readopen == 0 || myproc()->killed){
+        if(pa)
+          kfree(P2V(pa));
         release(&p->lock);
         return -1;
       }
-      wakeup(&p->nread);
+      if(p->rsleep)
+        wakeup(&p->nread);
+      p->wsleep++;
       sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+      p->wsleep--;
+    }
+    if(pa){
+      p->page[p->pgwrite++ % NPIPEPAGE] = pa;
+      m = PGSIZE;
+      continue;
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    // Copy up to the end of the free space or of the buffer,
+    // whichever comes first.
+    m = min(n - i, p->nread + PIPESIZE - p->nwrite);
+    m = min(m, PIPESIZE - p->nwrite % PIPESIZE);
+    memmove(p->data + p->nwrite % PIPESIZE, addr + i, m);
+    p->nwrite += m;
   }
-  wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  if(p->rsleep)
+    wakeup(&p->nread);  //DOC: pipewrite-wakeup1
   release(&p->lock);
   return n;
 }
 
+// Read from page[pgread] of p, which is queued, into addr.
+// Returns the number of bytes read, 0 if addr could not be
+// made writable.
+static uint
+readpage(struct pipe *p, char *addr, uint n)
+{
+  uint pa, m;
+
+  pa = p->page[p->pgread % NPIPEPAGE];
+  if(p->pgoff == 0 && (uint)addr % PGSIZE == 0 && n >= PGSIZE &&
+     pageflip(myproc()->pgdir, (uint)addr, pa) == 0){
+    p->pgread++;
+    return PGSIZE;
+  }
+  m = min(n, PGSIZE - p->pgoff);
+  if(pageinrange(myproc(), (uint)addr, m, 1) < 0)
+    return 0;
+  memmove(addr, (char*)P2V(pa) + p->pgoff, m);
+  p->pgoff += m;
+  if(p->pgoff == PGSIZE){
+    kfree(P2V(pa));
+    p->pgoff = 0;
+    p->pgread++;
+  }
+  return m;
+}
+
 int
 piperead(struct pipe *p, char *addr, int n)
 {
-  int i;
+  int i, failed;
+  uint m;
 
+  failed = 0;
   acquire(&p->lock);
-  while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
+  while(p->nread == p->nwrite && p->pgread == p->pgwrite &&
+        p->writeopen){  //DOC: pipe-empty
     if(myproc()->killed){
       release(&p->lock);
       return -1;
     }
+    p->rsleep++;
     sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+    p->rsleep--;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  // sys_read has filled in every page of addr, so making a
+  // shared page writable only allocates memory and does not
+  // sleep with p->lock held. Only the bytes that are copied are
+  // prepared, since a flipped page replaces the one at addr.
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
+    if(p->pgread != p->pgwrite){
+      if((m = readpage(p, addr + i, n - i)) == 0){
+        failed = 1;
+        break;
+      }
+      continue;
+    }
     if(p->nread == p->nwrite)
       break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+    m = min(n - i, p->nwrite - p->nread);
+    m = min(m, PIPESIZE - p->nread % PIPESIZE);
+    if(pageinrange(myproc(), (uint)addr + i, m, 1) < 0){
+      failed = 1;
+      break;
+    }
+    memmove(addr + i, p->data + p->nread % PIPESIZE, m);
+    p->nread += m;
   }
-  wakeup(&p->nwrite);  //DOC: piperead-wakeup
+  if(p->wsleep && (p->nread == p->nwrite ||
+                   p->nread + PIPESIZE - p->nwrite >= PIPEWAKE))
+    wakeup(&p->nwrite);  //DOC: piperead-wakeup
   release(&p->lock);
-  return i;
+  return i == 0 && failed ? -1 : i;
 }
@@ -0,0 +1,70 @@
+// Measure pipe throughput.
+//
+// A child writes TOTAL bytes into a pipe in chunks of a given
+// size while the parent reads them back, for chunk sizes from
+// 1 byte up to BUFSIZE. Small chunks mostly measure the system
+// call and wakeup overhead, large ones the copying, or with
+// page-aligned buffers the page flipping:
+//    $ pipebench
+// The timer ticks about 100 times per second.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define TOTAL (1024*1024)
+#define BUFSIZE 8192
+#define TICKS_PER_SEC 100
+#define PGSIZE 4096
+
+char *buf;
+
+int
+run(int chunk, int total)
+{
+  int fds[2], start, elapsed, n, left;
+
+  if(pipe(fds) < 0){
+    printf(2, "pipebench: pipe failed\n");
+    exit();
+  }
+  start = uptime();
+  if(fork() == 0){
+    close(fds[0]);
+    for(left = total; left > 0; left -= n)
+      if((n = write(fds[1], buf, left < chunk ? left : chunk)) <= 0)
+        break;
+    exit();
+  }
+  close(fds[1]);
+  for(left = total; left > 0; left -= n)
+    if((n = read(fds[0], buf, BUFSIZE)) <= 0)
+      break;
+  close(fds[0]);
+  wait();
+  if(left > 0)
+    printf(2, "pipebench: %d bytes missing\n", left);
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+  return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int chunk, total, ticks;
+
+  // Page-aligned, so that whole pages can change hands.
+  buf = sbrk(BUFSIZE + PGSIZE);
+  buf += PGSIZE - (uint)buf % PGSIZE;
+  memset(buf, 'x', BUFSIZE);
+  for(chunk = 1; chunk <= BUFSIZE; chunk *= 8){
+    // Byte-sized writes are slow, do fewer of them.
+    total = chunk == 1 ? TOTAL / 16 : TOTAL;
+    ticks = run(chunk, total);
+    printf(1, "%d-byte writes: %d bytes in %d ticks, %d KB/s\n",
+           chunk, total, ticks, total / 1024 * TICKS_PER_SEC / ticks);
+  }
+  exit();
+}
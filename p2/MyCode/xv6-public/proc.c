@@ -6,12 +6,33 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "pstat.h"
+
+// Ticks a process may run at a level before it moves down.
+#define QUANTUM(level) (1 << (level))
+
+// Stride of a process holding one ticket, and the most
+// tickets a process may hold.
+#define STRIDE1 (1 << 16)
 
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
 } ptable;
 
+// MLFQ run queues of one CPU, one per level, holding
+// RUNNABLE processes. Each CPU has its own lock, so CPUs
+// looking for work do not contend on ptable.lock.
+// Lock order: ptable.lock before a run queue lock.
+struct runq {
+  struct spinlock lock;
+  struct proc *qhead[NMLFQ];
+  struct proc *qtail[NMLFQ];
+  int nready;                  // Processes in the queues
+  uint pass;                   // Stride: pass of the last process run
+  uint seed;                   // Lottery: random number state
+} runqs[NCPU];
+
 static struct proc *initproc;
 
 int nextpid = 1;
@@ -19,11 +40,19 @@ extern void forkret(void);
 extern void trapret(void);
 
 static void wakeup1(void *chan);
+static void enqueue(struct proc *p);
+static int idlestcpu(void);
 
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NCPU; i++){
+    initlock(&runqs[i].lock, "runq");
+    runqs[i].seed = 2463534242U + i;
+  }
 }
 
 // Must be called with interrupts disabled
@@ -88,6 +117,13 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->priority = 0;
+  p->slice = 0;
+  memset(p->ticks, 0, sizeof(p->ticks));
+  p->cpu = 0;
+  p->tickets = 1;
+  p->stride = STRIDE1;
+  p->pass = 0;
 
   release(&ptable.lock);
 
@@ -148,7 +184,7 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  enqueue(p);
 
   release(&ptable.lock);
 }
@@ -168,6 +204,7 @@ growproc(int n)
   } else if(n < 0){
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
+    trimsegs(curproc->segs, sz);
   }
   curproc->sz = sz;
   switchuvm(curproc);
@@ -207,6 +244,10 @@ fork(void)
     if(curproc->ofile[i])
       np->ofile[i] = filedup(curproc->ofile[i]);
   np->cwd = idup(curproc->cwd);
+  dupsegs(np->segs, curproc->segs);
+  np->tickets = curproc->tickets;
+  np->stride = curproc->stride;
+  np->pass = curproc->pass;
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -214,7 +255,8 @@ fork(void)
 
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  np->cpu = idlestcpu();
+  enqueue(np);
 
   release(&ptable.lock);
 
@@ -245,6 +287,9 @@ exit(void)
   begin_op();
   iput(curproc->cwd);
   end_op();
+  begin_op();
+  putsegs(curproc->segs);
+  end_op();
   curproc->cwd = 0;
 
   acquire(&ptable.lock);
@@ -312,10 +357,227 @@ wait(void)
 }
 
 //PAGEBREAK: 42
+// Multi-level feedback queue.
+// RUNNABLE processes wait in the run queue of their level
+// on one CPU, and each CPU runs the first process of its
+// highest non-empty level, stealing work when it has none. A process starts at level 0 and
+// moves down a level once it has used QUANTUM(level) ticks
+// there, whether in one go or across several runs, so
+// CPU-bound processes sink while interactive ones stay on
+// top. Every BOOSTTICKS ticks all processes go back to
+// level 0, so that nothing starves.
+//
+// Built with SCHED=STRIDE or SCHED=LOTTERY, every process
+// stays at level 0 and the CPU is shared in proportion to
+// the tickets set with settickets(). Stride scheduling runs
+// the process with the lowest pass, which advances by
+// STRIDE1/tickets each tick it runs; lottery scheduling
+// draws a ticket at random. Shares hold among the processes
+// of one CPU, which work stealing keeps roughly balanced.
+
+// Make p RUNNABLE at the tail of the run queue of its level,
+// on the CPU it last ran on, which likely still caches it.
+// The ptable lock must be held.
+static void
+enqueue(struct proc *p)
+{
+  struct runq *rq = &runqs[p->cpu];
+
+  p->state = RUNNABLE;
+  p->qnext = 0;
+  acquire(&rq->lock);
+#ifdef SCHED_STRIDE
+  // Do not let a process that slept catch up on the time
+  // it did not want the CPU, monopolizing it meanwhile.
+  if((int)(p->pass - rq->pass) < 0)
+    p->pass = rq->pass;
+#endif
+  if(rq->qtail[p->priority])
+    rq->qtail[p->priority]->qnext = p;
+  else
+    rq->qhead[p->priority] = p;
+  rq->qtail[p->priority] = p;
+  rq->nready++;
+  release(&rq->lock);
+}
+
+#ifndef SCHED_MLFQ
+// Return the link to the process of level 0 of run queue
+// rq that should run next under the proportional-share
+// policy. The queue must not be empty. Caller holds rq->lock.
+static struct proc**
+pick(struct runq *rq)
+{
+  struct proc **pp, **best;
+#ifdef SCHED_STRIDE
+  best = &rq->qhead[0];
+  for(pp = &rq->qhead[0]; *pp; pp = &(*pp)->qnext)
+    if((int)((*pp)->pass - (*best)->pass) < 0)
+      best = pp;
+#else
+  uint total, draw;
+
+  total = 0;
+  for(pp = &rq->qhead[0]; *pp; pp = &(*pp)->qnext)
+    total += (*pp)->tickets;
+  // xorshift32
+  rq->seed ^= rq->seed << 13;
+  rq->seed ^= rq->seed >> 17;
+  rq->seed ^= rq->seed << 5;
+  draw = rq->seed % total;
+  for(best = &rq->qhead[0]; draw >= (*best)->tickets; best = &(*best)->qnext)
+    draw -= (*best)->tickets;
+#endif
+  return best;
+}
+#endif
+
+// Take the first process of the highest non-empty level
+// of run queue rq, or return 0 if it is empty.
+static struct proc*
+dequeue(struct runq *rq)
+{
+  struct proc *p;
+  int level;
+#ifndef SCHED_MLFQ
+  struct proc **pp;
+#endif
+
+  if(rq->nready == 0)
+    return 0;
+  acquire(&rq->lock);
+#ifndef SCHED_MLFQ
+  if(rq->qhead[0] != 0){
+    pp = pick(rq);
+    p = *pp;
+    *pp = p->qnext;
+    if(rq->qtail[0] == p){
+      rq->qtail[0] = rq->qhead[0];
+      while(rq->qtail[0] && rq->qtail[0]->qnext)
+        rq->qtail[0] = rq->qtail[0]->qnext;
+    }
+    p->qnext = 0;
+    rq->nready--;
+#ifdef SCHED_STRIDE
+    rq->pass = p->pass;
+#endif
+    release(&rq->lock);
+    return p;
+  }
+#endif
+  for(level = 0; level < NMLFQ; level++){
+    if((p = rq->qhead[level]) != 0){
+      rq->qhead[level] = p->qnext;
+      if(rq->qhead[level] == 0)
+        rq->qtail[level] = 0;
+      p->qnext = 0;
+      rq->nready--;
+      release(&rq->lock);
+      return p;
+    }
+  }
+  release(&rq->lock);
+  return 0;
+}
+
+// Called by an idle CPU: take a process from the CPU with
+// the most waiting processes.
+static struct proc*
+steal(int self)
+{
+  struct runq *rq, *busiest;
+
+  busiest = 0;
+  for(rq = runqs; rq < &runqs[ncpu]; rq++)
+    if(rq != &runqs[self] && rq->nready > 0 &&
+       (busiest == 0 || rq->nready > busiest->nready))
+      busiest = rq;
+  return busiest ? dequeue(busiest) : 0;
+}
+
+// Return the CPU with the fewest waiting processes, for a
+// new process that has no cache footprint anywhere yet.
+static int
+idlestcpu(void)
+{
+  int i, best;
+
+  best = 0;
+  for(i = 1; i < ncpu; i++)
+    if(runqs[i].nready < runqs[best].nready)
+      best = i;
+  return best;
+}
+
+// Charge the running process for a timer tick. Returns 1 if
+// it should give up the CPU, because it has used up its time
+// slice or a process at a higher level is waiting on this
+// CPU. Only the running process and mlfqboost() change its
+// level, and a boost racing with a tick is harmless, so
+// this runs without ptable.lock on every tick. Under the
+// proportional-share policies every tick ends the slice.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq = &runqs[cpuid()];
+#ifdef SCHED_MLFQ
+  int level, preempt;
+
+  preempt = 0;
+  p->ticks[p->priority]++;
+  if(++p->slice >= QUANTUM(p->priority)){
+    if(p->priority < NMLFQ-1)
+      p->priority++;
+    p->slice = 0;
+    preempt = 1;
+  }
+  for(level = 0; level < p->priority; level++)
+    if(rq->qhead[level])
+      preempt = 1;
+  return preempt;
+#else
+  p->ticks[0]++;
+  p->pass += p->stride;
+  return rq->nready > 0;
+#endif
+}
+
+// Move every process back to level 0, keeping the order
+// of the run queues. Called by the timer every BOOSTTICKS.
+void
+mlfqboost(void)
+{
+  struct proc *p;
+  struct runq *rq;
+  int level;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    p->priority = 0;
+    p->slice = 0;
+  }
+  for(rq = runqs; rq < &runqs[ncpu]; rq++){
+    acquire(&rq->lock);
+    for(level = 1; level < NMLFQ; level++){
+      if(rq->qhead[level] == 0)
+        continue;
+      if(rq->qtail[0])
+        rq->qtail[0]->qnext = rq->qhead[level];
+      else
+        rq->qhead[0] = rq->qhead[level];
+      rq->qtail[0] = rq->qtail[level];
+      rq->qhead[level] = rq->qtail[level] = 0;
+    }
+    release(&rq->lock);
+  }
+  release(&ptable.lock);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - choose a process to run from the run queues
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -324,32 +586,35 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = c - cpus;
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
+    // Pick from this CPU's run queues, or steal from
+    // another CPU if they are empty.
+    if((p = dequeue(&runqs[id])) == 0 && (p = steal(id)) == 0)
+      continue;
 
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
+    // Switch to chosen process.  It is the process's job
+    // to release ptable.lock and then reacquire it
+    // before jumping back to us. Taking the lock also
+    // waits for a process that was just preempted on
+    // another CPU to finish switching away there.
+    acquire(&ptable.lock);
+    p->cpu = id;
+    c->proc = p;
+    switchuvm(p);
+    p->state = RUNNING;
 
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
 
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
-    }
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
     release(&ptable.lock);
 
   }
@@ -386,7 +651,7 @@ void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  enqueue(myproc());
   sched();
   release(&ptable.lock);
 }
@@ -461,7 +726,7 @@ wakeup1(void *chan)
 
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
     if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+      enqueue(p);
 }
 
 // Wake up all processes sleeping on chan.
@@ -487,7 +752,7 @@ kill(int pid)
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        enqueue(p);
       release(&ptable.lock);
       return 0;
     }
@@ -496,6 +761,44 @@ kill(int pid)
   return -1;
 }
 
+// Set the share of the calling process under stride or
+// lottery scheduling. Returns -1 if n is out of range.
+int
+settickets(int n)
+{
+  struct proc *p = myproc();
+
+  if(n < 1 || n > STRIDE1)
+    return -1;
+  acquire(&ptable.lock);
+  p->tickets = n;
+  p->stride = STRIDE1 / n;
+  release(&ptable.lock);
+  return 0;
+}
+
+// Fill in scheduler statistics of every process slot.
+int
+getpinfo(struct pstat *ps)
+{
+  struct proc *p;
+  int i, level;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    i = p - ptable.proc;
+    ps->inuse[i] = p->state != UNUSED;
+    ps->pid[i] = p->pid;
+    ps->priority[i] = p->priority;
+    ps->state[i] = p->state;
+    ps->tickets[i] = p->tickets;
+    for(level = 0; level < NMLFQ; level++)
+      ps->ticks[i][level] = p->ticks[level];
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -34,6 +34,16 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// Part of the address space that exec() fills from the
+// program file on first touch instead of at load time.
+struct vmseg {
+  struct inode *ip;            // Program file, 0 if the slot is unused
+  uint va;                     // Start address, page aligned
+  uint memsz;                  // Bytes of memory in the segment
+  uint off;                    // File offset of va
+  uint filesz;                 // Bytes backed by the file, the rest is zero
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -48,6 +58,16 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vmseg segs[NSEG];     // Demand-paged program segments
+  int priority;                // MLFQ level, 0 is the highest
+  int slice;                   // Ticks used of the time slice at this level
+  int ticks[NMLFQ];            // Ticks received at each level
+  struct proc *qnext;          // Next process in the same run queue
+  int cpu;                     // CPU whose run queues p goes back to
+  int logleft;                 // Log blocks its FS call may still add
+  int tickets;                 // Share under stride or lottery scheduling
+  uint stride;                 // STRIDE1 / tickets
+  uint pass;                   // Virtual time, advances by stride per tick
   char name[16];               // Process name (debugging)
 };
 
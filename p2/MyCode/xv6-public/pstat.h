@@ -0,0 +1,16 @@
+#ifndef _PSTAT_H_
+#define _PSTAT_H_
+
+#include "param.h"
+
+// Scheduler statistics reported by getpinfo().
+struct pstat {
+  int inuse[NPROC];          // Whether this slot of the process table is in use (1 or 0)
+  int pid[NPROC];            // PID of each process
+  int priority[NPROC];       // Current MLFQ level of each process, 0 is the highest
+  int state[NPROC];          // Current state (e.g., SLEEPING or RUNNABLE) of each process
+  int ticks[NPROC][NMLFQ];   // Timer ticks each process has received at each level
+  int tickets[NPROC];        // Share of each process under stride or lottery scheduling
+};
+
+#endif // _PSTAT_H_
@@ -21,3 +21,5 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_getfilename 22
+#define SYS_getpinfo 23
+#define SYS_settickets 24
@@ -109,7 +109,7 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argoutptr(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
   return filestat(f, st);
 }
@@ -172,7 +172,7 @@ isdirempty(struct inode *dp)
   struct dirent de;
 
   for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+    if(readi(dp, (char*)&de, off, sizeof(de), 0) != sizeof(de))
       panic("isdirempty: readi");
     if(de.inum != 0)
       return 0;
@@ -218,6 +218,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcinval(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -329,8 +330,7 @@ sys_open(void)
   f->off = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
-  f->name = kalloc();
-  safestrcpy(f->name, path, 256);
+  safestrcpy(f->name, path, FNAMESZ);
   
   return fd;
 }
@@ -429,7 +429,7 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argoutptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
@@ -460,14 +460,14 @@ sys_getfilename(void)
     return -1;
   else if (argint(2, &n) < 0)// Get buffer length; should be 256
     return -1;
-  else if (argptr(1, &buf, n) < 0)  // Get buffer pointer
+  else if (argoutptr(1, &buf, n) < 0)  // Get buffer pointer
     return -1;
   else if (buf == 0)  // Check for null pointer
     return -1;
   else {
     // if (f != 0)
     // Now start to copy the file name
-    safestrcpy(buf, f->name, 256);
+    safestrcpy(buf, f->name, FNAMESZ);
     return 0;
   }
 
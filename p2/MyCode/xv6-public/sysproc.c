@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "pstat.h"
 
 int
 sys_fork(void)
@@ -51,7 +52,13 @@ sys_sbrk(void)
   if(argint(0, &n) < 0)
     return -1;
   addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if(n > 0){
+    // Only reserve the address range; pages are allocated
+    // and zeroed on first touch (see lazyfault in vm.c).
+    if((uint)addr + n < (uint)addr || (uint)addr + n >= KERNBASE)
+      return -1;
+    myproc()->sz += n;
+  } else if(growproc(n) < 0)
     return -1;
   return addr;
 }
@@ -89,3 +96,25 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// Report scheduler statistics of every process.
+int
+sys_getpinfo(void)
+{
+  struct pstat *ps;
+
+  if(argoutptr(0, (void*)&ps, sizeof(*ps)) < 0)
+    return -1;
+  return getpinfo(ps);
+}
+
+// Set the share of the calling process.
+int
+sys_settickets(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return settickets(n);
+}
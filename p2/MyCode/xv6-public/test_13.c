@@ -0,0 +1,62 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+// Processes write and read back their own files at the same time, going
+// through more blocks than the buffer cache holds
+#define NCHILD 4
+#define BLOCKS 40
+
+int check(int id)
+{
+    char name[8] = "bcache0";
+    char buf[512];
+    int fd, i, j;
+
+    name[6] += id;
+    if ((fd = open(name, O_CREATE | O_RDWR)) < 0)
+        return 0;
+    for (i = 0; i < BLOCKS; i++) {
+        memset(buf, 'a' + id + i % 8, sizeof(buf));
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+            return 0;
+    }
+    close(fd);
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return 0;
+    for (i = 0; i < BLOCKS; i++) {
+        if (read(fd, buf, sizeof(buf)) != sizeof(buf))
+            return 0;
+        for (j = 0; j < sizeof(buf); j++)
+            if (buf[j] != 'a' + id + i % 8)
+                return 0;
+    }
+    close(fd);
+    unlink(name);
+    return 1;
+}
+
+int main(void)
+{
+    int i, fds[2], ok = 1;
+    char result;
+
+    pipe(fds);
+    for (i = 0; i < NCHILD; i++) {
+        if (fork() == 0) {
+            result = check(i);
+            write(fds[1], &result, 1);
+            exit();
+        }
+    }
+    for (i = 0; i < NCHILD; i++) {
+        if (read(fds[0], &result, 1) != 1 || !result)
+            ok = 0;
+        wait();
+    }
+
+    printf(1, "XV6_TEST_OUTPUT Concurrent file contents: %d\n", ok);
+    exit();
+}
@@ -0,0 +1,46 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+int exists(char *path)
+{
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    close(fd);
+    return 1;
+}
+
+int main(void)
+{
+    int fd;
+    struct stat st;
+
+    // A miss is remembered, and must be forgotten once the name is created
+    printf(1, "XV6_TEST_OUTPUT Before create: %d\n", exists("dc_file"));
+    fd = open("dc_file", O_CREATE | O_RDWR);
+    close(fd);
+    printf(1, "XV6_TEST_OUTPUT After create: %d\n", exists("dc_file"));
+
+    link("dc_file", "dc_link");
+    printf(1, "XV6_TEST_OUTPUT After link: %d\n", exists("dc_link"));
+    unlink("dc_file");
+    printf(1, "XV6_TEST_OUTPUT After unlink: %d %d\n", exists("dc_file"), exists("dc_link"));
+    unlink("dc_link");
+
+    // A directory removed and made again must not see stale entries
+    mkdir("dc_dir");
+    fd = open("dc_dir/inner", O_CREATE | O_RDWR);
+    close(fd);
+    unlink("dc_dir/inner");
+    unlink("dc_dir");
+    printf(1, "XV6_TEST_OUTPUT Removed dir: %d\n", exists("dc_dir"));
+    mkdir("dc_dir");
+    printf(1, "XV6_TEST_OUTPUT Inner in new dir: %d\n", exists("dc_dir/inner"));
+    stat("dc_dir/..", &st);
+    printf(1, "XV6_TEST_OUTPUT Parent of new dir is root: %d\n", st.ino == 1);
+    unlink("dc_dir");
+    exit();
+}
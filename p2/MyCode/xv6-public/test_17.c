@@ -0,0 +1,66 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define PGSIZE 4096
+#define NPAGES 4
+#define LEN (NPAGES * PGSIZE + 100)
+
+char *alloc_aligned(int n)
+{
+    char *p = sbrk(n + PGSIZE);
+    return p + (PGSIZE - (uint)p % PGSIZE);
+}
+
+int main(void)
+{
+    int fds[2], i, n, got, bad = 0;
+    char *out, *in;
+
+    out = alloc_aligned(LEN);
+    in = alloc_aligned(LEN + 1);
+    // Touch the reader's pages so that they are really there to replace
+    memset(in, 0, LEN + 1);
+    for (i = 0; i < LEN; i++)
+        out[i] = 'a' + i % 26;
+
+    pipe(fds);
+    if (fork() == 0) {
+        close(fds[0]);
+        // Whole aligned pages, then the same again from an odd offset
+        write(fds[1], out, LEN);
+        write(fds[1], out + 1, PGSIZE);
+        // Changing the buffer afterwards must not change what was sent
+        for (i = 0; i < LEN; i++)
+            out[i] = '?';
+        close(fds[1]);
+        exit();
+    }
+    close(fds[1]);
+
+    // Read the first pages whole, then the rest in odd pieces
+    got = 0;
+    while (got < LEN && (n = read(fds[0], in + got, LEN - got)) > 0)
+        got += n;
+    for (i = 0; i < LEN; i++)
+        if (in[i] != 'a' + i % 26)
+            bad++;
+    printf(1, "XV6_TEST_OUTPUT Aligned bytes received: %d, wrong: %d\n", got, bad);
+
+    got = 0;
+    bad = 0;
+    while ((n = read(fds[0], in + 3, 1000)) > 0) {
+        for (i = 0; i < n; i++)
+            if (in[3 + i] != 'a' + (got + i + 1) % 26)
+                bad++;
+        got += n;
+    }
+    printf(1, "XV6_TEST_OUTPUT Unaligned bytes received: %d, wrong: %d\n", got, bad);
+
+    // The pages that were handed over must still be writable
+    in[0] = 'z';
+    printf(1, "XV6_TEST_OUTPUT Wrote to received page: %c\n", in[0]);
+    close(fds[0]);
+    wait();
+    exit();
+}
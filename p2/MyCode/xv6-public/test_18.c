@@ -0,0 +1,49 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define FILESIZE (60 * 512 + 123)
+
+char buf[4096];
+
+// Read the file in chunks of the given size and count bytes
+// that do not match what was written.
+int check(int chunk, int *total)
+{
+    int fd, n, i, bad = 0;
+
+    *total = 0;
+    fd = open("ra_file", O_RDONLY);
+    while ((n = read(fd, buf, chunk)) > 0) {
+        for (i = 0; i < n; i++)
+            if (buf[i] != (char)((*total + i) % 251))
+                bad++;
+        *total += n;
+    }
+    close(fd);
+    return bad;
+}
+
+int main(void)
+{
+    int fd, i, n, total, bad;
+
+    fd = open("ra_file", O_CREATE | O_RDWR);
+    for (total = 0; total < FILESIZE; total += n) {
+        n = FILESIZE - total < sizeof(buf) ? FILESIZE - total : sizeof(buf);
+        for (i = 0; i < n; i++)
+            buf[i] = (total + i) % 251;
+        write(fd, buf, n);
+    }
+    close(fd);
+
+    bad = check(1, &total);
+    printf(1, "XV6_TEST_OUTPUT 1-byte reads: %d bytes, %d wrong\n", total, bad);
+    bad = check(700, &total);
+    printf(1, "XV6_TEST_OUTPUT 700-byte reads: %d bytes, %d wrong\n", total, bad);
+    bad = check(4096, &total);
+    printf(1, "XV6_TEST_OUTPUT 4096-byte reads: %d bytes, %d wrong\n", total, bad);
+    unlink("ra_file");
+    exit();
+}
@@ -0,0 +1,46 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+// More than the kernel can back with physical memory
+#define HEAP_SIZE (300 * 1024 * 1024)
+
+char buffer[4096];
+
+int main(void)
+{
+    int i, n, fd, fds[2];
+    char c, *heap;
+
+    for (i = 0; i < sizeof(buffer); i++)
+        buffer[i] = 'p';
+    pipe(fds);
+
+    if (fork() == 0) {
+        // Use up free memory: write() fills in each heap page it reads
+        // from and fails once the kernel cannot allocate one
+        heap = sbrk(HEAP_SIZE);
+        for (i = 0; i < HEAP_SIZE; i += 4096) {
+            if (write(fds[1], heap + i, 1) != 1)
+                break;
+            read(fds[0], &c, 1);
+        }
+
+        // Reading into the shared buffer needs a copy of its page,
+        // which the system call has to report instead of panicking
+        fd = open("README", O_RDONLY);
+        n = read(fd, buffer, 64);
+        close(fd);
+        sbrk(-HEAP_SIZE);
+        printf(1, "XV6_TEST_OUTPUT Read without memory: %d\n", n);
+        exit();
+    }
+    wait();
+
+    for (i = 0; i < sizeof(buffer); i++)
+        if (buffer[i] != 'p')
+            break;
+    printf(1, "XV6_TEST_OUTPUT Parent memory unchanged: %d\n", i == sizeof(buffer));
+    exit();
+}
@@ -0,0 +1,34 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+// Spans several pages so that fork() shares them copy-on-write
+char buffer[4 * 4096];
+
+int main(void)
+{
+    int i, pid, ok = 1;
+
+    for (i = 0; i < sizeof(buffer); i++)
+        buffer[i] = 'p';
+
+    pid = fork();
+    if (pid == 0) {
+        // User writes and kernel writes (read() into the buffer) both
+        // have to copy the page instead of changing the parent's
+        for (i = 0; i < sizeof(buffer); i += 4096)
+            buffer[i] = 'c';
+        int fd = open("README", O_RDONLY);
+        read(fd, buffer + 4096 + 100, 64);
+        close(fd);
+        exit();
+    }
+    wait();
+
+    for (i = 0; i < sizeof(buffer); i++)
+        if (buffer[i] != 'p')
+            ok = 0;
+    printf(1, "XV6_TEST_OUTPUT Parent memory unchanged: %d\n", ok);
+    exit();
+}
@@ -53,6 +53,10 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+#ifdef SCHED_MLFQ
+      if(ticks % BOOSTTICKS == 0)
+        mlfqboost();
+#endif
     }
     lapiceoi();
     break;
@@ -78,6 +82,26 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // Faults from user code, or from the kernel touching user memory
+    // during a system call. A missing page below sz is either part of
+    // the program, which exec() did not read yet, or heap that sbrk()
+    // has not allocated yet. Program pages are read from disk, which
+    // system calls avoid by faulting them in when checking arguments.
+    // They also copy shared pages they write to up front, so that a
+    // fault the kernel takes itself never runs out of memory.
+    if(myproc() != 0 && !(tf->err & FEC_PR) && (tf->cs&3) == DPL_USER &&
+       pagein(myproc(), rcr2()) == 0)
+      break;
+    if(myproc() != 0 && !(tf->err & FEC_PR) &&
+       lazyfault(myproc(), rcr2()) == 0)
+      break;
+    // A write to a page shared copy-on-write after fork().
+    if(myproc() != 0 && (tf->err & FEC_WR) &&
+       cowfault(myproc()->pgdir, rcr2()) == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
@@ -100,10 +124,11 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU on clock tick once its
+  // time slice is used up (see schedtick in proc.c).
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+     tf->trapno == T_IRQ0+IRQ_TIMER && schedtick())
     yield();
 
   // Check if the process has been killed since we yielded
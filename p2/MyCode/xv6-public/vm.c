@@ -210,7 +210,7 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
       n = sz - i;
     else
       n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
+    if(readi(ip, P2V(pa), offset+i, n, 0) != n)
       return -1;
   }
   return 0;
@@ -311,39 +311,288 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child. Pages are not copied: both page
+// tables map them read-only with PTE_COW set, and the
+// first write to one copies it (see cowfault).
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
   pte_t *pte;
   uint pa, i, flags;
-  char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
+    // Heap pages that were never touched stay unmapped
+    // in the child as well.
     if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+      continue;
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
       goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
-      goto bad;
-    }
+    kincref(P2V(pa));
   }
+  // The parent may still have writable entries in its TLB.
+  lcr3(V2P(pgdir));
   return d;
 
 bad:
+  lcr3(V2P(pgdir));
   freevm(d);
   return 0;
 }
 
+// Return the program segment of p that covers user
+// virtual address va, or 0 if there is none.
+static struct vmseg*
+findseg(struct proc *p, uint va)
+{
+  struct vmseg *s;
+
+  for(s = p->segs; s < &p->segs[NSEG]; s++)
+    if(s->ip && va >= s->va && va - s->va < s->memsz)
+      return s;
+  return 0;
+}
+
+// Handle a fault on a page that sbrk() added to the heap
+// of p without allocating it: map a zeroed page at va.
+// Returns 0 if the fault was handled, -1 otherwise.
+int
+lazyfault(struct proc *p, uint va)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va >= p->sz || va >= KERNBASE)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if(findseg(p, va) != 0)
+    return -1;
+  if((pte = walkpgdir(p->pgdir, (void*)va, 0)) != 0 && (*pte & PTE_P))
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(p->pgdir, (void*)va, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fill the page at user virtual address va from the
+// program segment of p that covers it. Reads the program
+// file, so it may sleep and must not be called with locks
+// held; system calls fault in their user buffers up front
+// (see pageinrange).
+// Returns 0 if the fault was handled, -1 otherwise.
+int
+pagein(struct proc *p, uint va)
+{
+  struct vmseg *s;
+  pte_t *pte;
+  char *mem;
+  uint off, n;
+
+  if(va >= p->sz || va >= KERNBASE)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((s = findseg(p, va)) == 0)
+    return -1;
+  if((pte = walkpgdir(p->pgdir, (void*)va, 0)) != 0 && (*pte & PTE_P))
+    return -1;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  off = va - s->va;
+  if(off < s->filesz){
+    n = s->filesz - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    ilock(s->ip);
+    if(readi(s->ip, mem, s->off + off, n, 0) != n){
+      iunlock(s->ip);
+      kfree(mem);
+      return -1;
+    }
+    iunlock(s->ip);
+  }
+  if(mappages(p->pgdir, (void*)va, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fill every page of [va, va+len) that has not been touched
+// yet, from the program or with zeroes, and if write is set
+// break copy-on-write sharing, so that the kernel can use the
+// range without faulting. A fault the kernel takes itself
+// cannot fail, so running out of memory here is the only way
+// a system call can report it. The caller has checked that
+// the range lies below p->sz.
+// Returns 0 on success, -1 if a page could not be filled.
+int
+pageinrange(struct proc *p, uint va, uint len, int write)
+{
+  pte_t *pte;
+  uint a, last;
+
+  if(len == 0)
+    return 0;
+  last = PGROUNDDOWN(va + len - 1);
+  for(a = PGROUNDDOWN(va); ; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (void*)a, 0);
+    if(pte == 0 || (*pte & PTE_P) == 0){
+      if((findseg(p, a) ? pagein(p, a) : lazyfault(p, a)) < 0)
+        return -1;
+      pte = walkpgdir(p->pgdir, (void*)a, 0);
+    }
+    if(write && (*pte & PTE_COW) && cowfault(p->pgdir, a) < 0)
+      return -1;
+    if(a == last)
+      break;
+  }
+  return 0;
+}
+
+// Give a forked child its own references to the program
+// segments of its parent.
+void
+dupsegs(struct vmseg *dst, struct vmseg *src)
+{
+  int i;
+
+  for(i = 0; i < NSEG; i++){
+    dst[i] = src[i];
+    if(src[i].ip)
+      dst[i].ip = idup(src[i].ip);
+  }
+}
+
+// Drop the program segments in segs.
+// Must be called inside a transaction, since it calls iput().
+void
+putsegs(struct vmseg *segs)
+{
+  int i;
+
+  for(i = 0; i < NSEG; i++){
+    if(segs[i].ip)
+      iput(segs[i].ip);
+    segs[i].ip = 0;
+  }
+}
+
+// Cut program segments off at sz after the process has
+// shrunk, so that regrown memory starts out zeroed.
+void
+trimsegs(struct vmseg *segs, uint sz)
+{
+  int i;
+
+  for(i = 0; i < NSEG; i++){
+    if(segs[i].ip == 0 || segs[i].va + segs[i].memsz <= sz)
+      continue;
+    segs[i].memsz = sz > segs[i].va ? sz - segs[i].va : 0;
+    if(segs[i].filesz > segs[i].memsz)
+      segs[i].filesz = segs[i].memsz;
+  }
+}
+
+// Handle a write fault at user virtual address va in
+// pgdir. If the page is shared copy-on-write, give this
+// page table its own writable copy, or simply make the
+// page writable if no one else maps it any more.
+// Returns 0 if the fault was handled, -1 otherwise.
+int
+cowfault(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcount(P2V(pa)) == 1){
+    *pte = pa | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)P2V(pa), PGSIZE);
+    *pte = V2P(mem) | flags;
+    kfree(P2V(pa));
+  }
+  invlpg((void*)PGROUNDDOWN(va));
+  return 0;
+}
+
+// Is pte a present user page that may be written to,
+// possibly after breaking copy-on-write sharing?
+static int
+userwritable(pte_t *pte)
+{
+  return pte && (*pte & (PTE_P|PTE_U)) == (PTE_P|PTE_U) &&
+         (*pte & (PTE_W|PTE_COW));
+}
+
+// Lend the user page at page-aligned va in pgdir, for a pipe
+// to hand to its reader: share it copy-on-write and return
+// its physical address with a reference for the borrower.
+// Returns 0 if there is no writable user page at va.
+uint
+pageloan(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+
+  if(va >= KERNBASE)
+    return 0;
+  pte = walkpgdir(pgdir, (void*)va, 0);
+  if(!userwritable(pte))
+    return 0;
+  if(*pte & PTE_W){
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    invlpg((void*)va);
+  }
+  kincref(P2V(PTE_ADDR(*pte)));
+  return PTE_ADDR(*pte);
+}
+
+// Map the page at physical address pa, lent by pageloan(),
+// copy-on-write at page-aligned va in pgdir instead of the
+// page there, taking over the borrowed reference. Returns -1
+// and leaves pgdir alone if there is no writable user page
+// at va. pgdir must be the current page table.
+int
+pageflip(pde_t *pgdir, uint va, uint pa)
+{
+  pte_t *pte;
+  uint old;
+
+  if(va >= KERNBASE)
+    return -1;
+  pte = walkpgdir(pgdir, (void*)va, 0);
+  if(!userwritable(pte))
+    return -1;
+  old = PTE_ADDR(*pte);
+  *pte = pa | ((PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW);
+  invlpg((void*)va);
+  kfree(P2V(old));
+  return 0;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -352,7 +601,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -367,10 +616,16 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    // Writes through the kernel mapping do not fault,
+    // so break copy-on-write sharing by hand.
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if(pte && (*pte & PTE_COW) && cowfault(pgdir, va0) < 0)
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
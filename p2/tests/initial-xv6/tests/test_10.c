@@ -0,0 +1,39 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+// More than the kernel can back with physical memory
+#define HEAP_SIZE (300 * 1024 * 1024)
+
+int main(void)
+{
+    int ok = 1;
+    char *heap = sbrk(HEAP_SIZE);
+
+    if (heap == (char *) -1) {
+        printf(1, "XV6_TEST_OUTPUT sbrk failed\n");
+        exit();
+    }
+
+    // Pages appear zeroed on first touch, from user code or from the kernel
+    if (heap[0] != 0 || heap[HEAP_SIZE - 1] != 0)
+        ok = 0;
+    heap[HEAP_SIZE / 2] = 'x';
+    int fd = open("README", O_RDONLY);
+    if (read(fd, heap + HEAP_SIZE / 4, 16) != 16)
+        ok = 0;
+    close(fd);
+
+    // The child sees touched pages and gets fresh ones for the rest
+    if (fork() == 0) {
+        if (heap[HEAP_SIZE / 2] != 'x' || heap[HEAP_SIZE / 3] != 0)
+            printf(1, "XV6_TEST_OUTPUT Child heap wrong\n");
+        exit();
+    }
+    wait();
+
+    sbrk(-HEAP_SIZE);
+    printf(1, "XV6_TEST_OUTPUT Lazy heap: %d\n", ok);
+    exit();
+}
@@ -0,0 +1,58 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+// Several processes allocate and free pages at the same time, so that
+// with CPUS > 1 every CPU's free list is refilled, drained and stolen from
+#define NCHILD 4
+#define ROUNDS 200
+#define PAGES 32
+
+int stress(int id)
+{
+    int round, i;
+    char *p;
+
+    for (round = 0; round < ROUNDS; round++) {
+        p = sbrk(PAGES * 4096);
+        if (p == (char *) -1)
+            return 0;
+        // A page handed out twice would be overwritten by another process
+        for (i = 0; i < PAGES; i++)
+            p[i * 4096] = id + i;
+        if (round % 20 == 0 && fork() == 0)
+            exit();
+        for (i = 0; i < PAGES; i++)
+            if (p[i * 4096] != (char) (id + i))
+                return 0;
+        sbrk(-PAGES * 4096);
+        if (round % 20 == 0)
+            wait();
+    }
+    return 1;
+}
+
+int main(void)
+{
+    int i, fds[2], ok = 1;
+    char result;
+    int start = uptime();
+
+    pipe(fds);
+    for (i = 0; i < NCHILD; i++) {
+        if (fork() == 0) {
+            result = stress(i * 16);
+            write(fds[1], &result, 1);
+            exit();
+        }
+    }
+    for (i = 0; i < NCHILD; i++) {
+        if (read(fds[0], &result, 1) != 1 || !result)
+            ok = 0;
+        wait();
+    }
+
+    printf(1, "XV6_TEST_OUTPUT Allocation stress: %d\n", ok);
+    printf(1, "%d processes, %d ticks\n", NCHILD, uptime() - start);
+    exit();
+}
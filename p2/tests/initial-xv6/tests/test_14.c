@@ -0,0 +1,42 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "pstat.h"
+
+struct pstat ps;
+
+int main(void)
+{
+    int i, level, pid, found = 0, demoted = 0;
+
+    pid = fork();
+    if (pid == 0) {
+        // CPU-bound child, it keeps using up its time slices
+        for (;;)
+            ;
+    }
+    sleep(30);
+
+    if (getpinfo(&ps) < 0) {
+        printf(1, "XV6_TEST_OUTPUT getpinfo failed\n");
+        kill(pid);
+        wait();
+        exit();
+    }
+    for (i = 0; i < NPROC; i++) {
+        if (!ps.inuse[i])
+            continue;
+        if (ps.pid[i] == getpid())
+            found = 1;
+        if (ps.pid[i] == pid)
+            for (level = 1; level < NMLFQ; level++)
+                if (ps.ticks[i][level] > 0)
+                    demoted = 1;
+    }
+    kill(pid);
+    wait();
+
+    printf(1, "XV6_TEST_OUTPUT Own slot found: %d\n", found);
+    printf(1, "XV6_TEST_OUTPUT Spinner reached lower levels: %d\n", demoted);
+    exit();
+}
@@ -0,0 +1,39 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "pstat.h"
+
+struct pstat ps;
+
+int tickets_of(int pid)
+{
+    int i;
+
+    if (getpinfo(&ps) < 0)
+        return -1;
+    for (i = 0; i < NPROC; i++)
+        if (ps.inuse[i] && ps.pid[i] == pid)
+            return ps.tickets[i];
+    return -1;
+}
+
+int main(void)
+{
+    int pid, child;
+
+    printf(1, "XV6_TEST_OUTPUT Default tickets: %d\n", tickets_of(getpid()));
+    printf(1, "XV6_TEST_OUTPUT settickets(0): %d\n", settickets(0));
+    printf(1, "XV6_TEST_OUTPUT settickets(10): %d\n", settickets(10));
+    printf(1, "XV6_TEST_OUTPUT Tickets now: %d\n", tickets_of(getpid()));
+
+    pid = fork();
+    if (pid == 0) {
+        sleep(100);
+        exit();
+    }
+    child = tickets_of(pid);
+    kill(pid);
+    wait();
+    printf(1, "XV6_TEST_OUTPUT Child inherited tickets: %d\n", child);
+    exit();
+}
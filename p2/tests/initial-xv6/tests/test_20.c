@@ -0,0 +1,48 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "pstat.h"
+
+struct pstat ps;
+
+int ticks_of(int pid)
+{
+    int i, level, n = 0;
+
+    for (i = 0; i < NPROC; i++)
+        if (ps.inuse[i] && ps.pid[i] == pid)
+            for (level = 0; level < NMLFQ; level++)
+                n += ps.ticks[i][level];
+    return n;
+}
+
+void spin(int tickets)
+{
+    settickets(tickets);
+    for (;;)
+        ;
+}
+
+int main(void)
+{
+    int a, b, ta, tb;
+
+    // Two children compete for the only CPU with a 3:1 share
+    if ((a = fork()) == 0)
+        spin(3);
+    if ((b = fork()) == 0)
+        spin(1);
+    sleep(300);
+
+    getpinfo(&ps);
+    ta = ticks_of(a);
+    tb = ticks_of(b);
+    kill(a);
+    kill(b);
+    wait();
+    wait();
+
+    printf(1, "XV6_TEST_OUTPUT Both children ran: %d\n", ta > 0 && tb > 0);
+    printf(1, "XV6_TEST_OUTPUT Ticks follow 3:1 tickets: %d\n", ta >= 2 * tb && ta <= 4 * tb);
+    exit();
+}
@@ -1,34 +1,184 @@
+#define _GNU_SOURCE                                 // splice() and copy_file_range()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <time.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <ctype.h>
+#include <errno.h>
 
 #define MAX_LINE 1024                               // Maximum length of an input command
-#define MAX_ARGS 256                                // Maximum number of arguments in a command
+#define ARENA_BLOCK_SIZE 4096                       // Minimum size of a line arena block
 #define DEFAULT_HISTORY_SIZE 5                      // Default history capacity
-#define MAX_LOCAL_VARIABLES 1024                    // Default local variables capacity
+#define HISTORY_FILE_ENV "WSH_HISTFILE"             // Environment variable naming the history file
+#define DEFAULT_LOCAL_BUCKETS 64                    // Initial number of local variable hash buckets
 #define PROMPT "wsh> "                              // Prompt string
+#define TIME_COMMAND "time"                         // Prefix that reports resource usage of a command
+#define TIMING_ENV "WSH_TIMING"                     // If set, report resource usage of every command
+#define COPROC_TIMEOUT_MS 3000                      // Time a coprocess has to answer one request
+#define COPY_COMMAND "cat"                          // Command run by the in-shell copy helper
+#define COPY_CHUNK (1 << 20)                        // Bytes moved per splice/copy_file_range call
+#define SCRIPT_CACHE_SUFFIX "c"                     // Cache of "script.wsh" is "script.wshc"
+#define SCRIPT_CACHE_MAGIC 0x43485357u              // "WSHC"
+#define SCRIPT_CACHE_VERSION 1                      // Bump when the cache layout changes
+#define SCRIPT_LINE_PIPELINE 0x01                   // Compiled line contains '|'
+#define SCRIPT_LINE_REPARSE 0x02                    // Line could not be compiled, parse it at run time
+#define SCRIPT_TOKEN_VARIABLE 0x80                  // Token is a variable slot, its text is the name
+#define BATCH_BARRIER "wait"                        // Batch line that waits for all running jobs
+#define BATCH_TAG_PREFIX '@'                        // Prefix of a batch dependency tag, e.g. "@build make"
+#define MAX_EVENTS 16                               // Events handled per epoll_wait() call
+#define EVENT_SIGNAL UINT64_MAX                     // epoll data of the signalfd
+#define EVENT_STDIN (UINT64_MAX - 1)                // epoll data of stdin, children use their index or pid
+#define EVENT_FD (UINT64_MAX - 2)                   // epoll data of the descriptor in wait_for_fd()
 
 typedef struct {
-    char **commands;                                // Array of commands
+    char **commands;                                // Circular buffer of commands
     int capacity;                                   // Capacity of the array
     int size;                                       // Number of elements in history
+    int newest;                                     // Index of the most recent command
+    char *file_name;                                // History file, NULL if disabled
+    FILE *file;                                     // History file opened for appending
+    int loaded;                                     // 1 once the history file has been read
 } HISTORY;
 
+typedef struct LOCALVAR {
+    char *name;                                     // Variable name
+    char *value;                                    // Variable value
+    struct LOCALVAR *bucket_next;                   // Next variable in the same hash bucket
+    struct LOCALVAR *prev;                          // Previous variable in insertion order
+    struct LOCALVAR *next;                          // Next variable in insertion order
+} LOCALVAR;
+
 typedef struct {
-    char **var_name;                                 // Variable name
-    char **var_value;                                // Variable value
-    int num_vars;                                    // Number of variables
+    LOCALVAR **buckets;                             // Hash buckets of variables
+    int num_buckets;                                // Number of buckets, a power of two
+    LOCALVAR *first;                                // Oldest variable
+    LOCALVAR *last;                                 // Newest variable
+    int num_vars;                                   // Number of variables
 } LOCALVARS;
 
+typedef struct {
+    char *name;                                     // Name used by "coproc send"
+    pid_t pid;                                      // Worker process id
+    FILE *to;                                       // Write end of the worker's stdin
+    int from;                                       // Read end of the worker's stdout
+} COPROC;
+
+typedef struct {
+    COPROC *procs;                                  // Array of running coprocesses
+    int capacity;                                   // Capacity of the array
+    int size;                                       // Number of coprocesses
+} COPROCS;
+
+typedef struct ARENABLOCK {
+    struct ARENABLOCK *next;                        // Next block in the arena
+    size_t size;                                    // Usable bytes in data
+    size_t used;                                    // Bytes handed out since the last reset
+    char data[];                                    // Memory handed out by arena_alloc()
+} ARENABLOCK;
+
+typedef struct {
+    ARENABLOCK *first;                              // First block
+    ARENABLOCK *current;                            // Block that allocations come from
+    ARENABLOCK *last;                               // Last block
+} ARENA;
+
+typedef enum {
+    TOKEN_END,                                      // No more tokens
+    TOKEN_ERROR,                                    // Redirection without a file name
+    TOKEN_ARG,                                      // Argument
+    TOKEN_INPUT,                                    // "<file"
+    TOKEN_OUTPUT,                                   // ">file"
+    TOKEN_APPEND,                                   // ">>file"
+    TOKEN_ERROR_TO_OUTPUT                           // "2>&1"
+} TOKENKIND;
+
+typedef struct {
+    TOKENKIND kind;                                 // TOKEN_INPUT, TOKEN_OUTPUT, ...
+    char *file;                                     // File name, NULL for "2>&1"
+} REDIRECT;
+
+typedef struct {
+    char **argv;                                    // NULL-terminated arguments
+    int argc;                                       // Number of arguments
+    REDIRECT *redirs;                               // Redirections in the order given
+    int num_redirs;                                 // Number of redirections
+} SIMPLECMD;
+
+typedef struct {
+    char *line;                                     // Input line as typed, for history
+    SIMPLECMD *cmds;                                // Pipeline stages
+    int num_cmds;                                   // Number of stages
+    int pipeline;                                   // 1 if the line contains '|'
+    int timed;                                      // 1 if the line starts with "time"
+} COMMAND;
+
+typedef enum {
+    JOB_PENDING,                                    // Waiting for a worker or a dependency
+    JOB_RUNNING,                                    // Running in a worker process
+    JOB_DONE                                        // Finished, output not yet flushed
+} JOBSTATE;
+
+typedef struct {
+    COMMAND command;                                // Parsed command line
+    char *tag;                                      // Dependency tag, NULL if untagged
+    int after;                                      // Job this one depends on, -1 if none
+    pid_t pid;                                      // Worker process id
+    int pidfd;                                      // pidfd watched by the event loop, -1 if none
+    FILE *output;                                   // Captured stdout
+    FILE *errors;                                   // Captured stderr
+    JOBSTATE state;                                 // Current state of the job
+} BATCHJOB;
+
+typedef struct {
+    BATCHJOB *jobs;                                 // Jobs between two barriers, in script order
+    int capacity;                                   // Capacity of the array
+    int size;                                       // Number of jobs in the group
+} BATCHGROUP;
+
+typedef struct {
+    char *data;                                     // Bytes
+    size_t size;                                    // Number of bytes used
+    size_t capacity;                                // Capacity of the buffer
+} BYTEBUF;
+
+typedef struct {
+    uint32_t magic;                                 // SCRIPT_CACHE_MAGIC
+    uint32_t version;                               // SCRIPT_CACHE_VERSION
+    int64_t source_mtime_sec;                       // Modification time of the batch file
+    int64_t source_mtime_nsec;
+    int64_t source_size;                            // Size of the batch file
+    uint64_t source_hash;                           // Hash of the batch file contents
+    uint64_t body_size;                             // Bytes of compiled lines after the header
+    uint64_t body_hash;                             // Hash of the compiled lines
+} SCRIPTHEADER;
+
+typedef struct {
+    int epoll_fd;                                   // epoll instance, -1 if unavailable
+    int signal_fd;                                  // signalfd for SIGINT and SIGQUIT, -1 if unused
+    int poll_stdin;                                 // 1 if stdin can be watched by epoll
+    sigset_t old_mask;                              // Signal mask restored in children
+} EVENTLOOP;
+
 // Function declaration
 
 // History
 HISTORY* init_history();
+void open_history_file(HISTORY *history, const char *file_name);
+void load_history(HISTORY *history);
+void push_history(HISTORY *history, const char *cmd);
 void add_history(HISTORY *history, const char *cmd);
 void resize_history(HISTORY *history, int new_capacity);
 void display_history(HISTORY *history);
@@ -36,339 +186,1763 @@ void get_history(HISTORY *history, int index, char **cmd);
 void free_history(HISTORY *history);
 // Local variables
 LOCALVARS* init_local_vars();
+unsigned int hash_local_var(const char *name);
+LOCALVAR** find_local_var(LOCALVARS *local_vars, const char *name);
+void rehash_local_vars(LOCALVARS *local_vars, int new_num_buckets);
 void add_local_var(LOCALVARS *local_vars, const char *name, const char *value);
-char* get_local_var(LOCALVARS *local_vars, const char *name);
+const char* get_local_var(LOCALVARS *local_vars, const char *name);
 void remove_local_var(LOCALVARS *local_vars, const char *name);
 void display_local_vars(LOCALVARS *local_vars);
 void free_local_vars(LOCALVARS *local_vars);
+// Coprocesses
+COPROCS* init_coprocs();
+COPROC* find_coproc(COPROCS *coprocs, const char *name);
+void start_coproc(COPROCS *coprocs, const char *name, char **argv);
+void send_coproc(COPROCS *coprocs, const char *name, char **words, int num_words);
+void stop_coproc(COPROCS *coprocs, const char *name);
+void display_coprocs(COPROCS *coprocs);
+void free_coprocs(COPROCS *coprocs);
+// Line arena
+ARENA* init_arena();
+void* arena_alloc(ARENA *arena, size_t size);
+char* arena_strdup(ARENA *arena, const char *str);
+void reset_arena(ARENA *arena);
+void free_arena(ARENA *arena);
 // Parsing and checking
-int parse_single_command(const char *cmd, char ***args);
-int parse_pipe_command(const char *cmd, char ***commands);
+int parse_command_line(const char *line, COMMAND *command);
+int parse_single_command(char *stage, SIMPLECMD *cmd);
+void init_single_command(SIMPLECMD *cmd, int max_args);
+TOKENKIND next_token(char **stage, char **token);
+int add_token(SIMPLECMD *cmd, TOKENKIND kind, char *value);
+char* expand_token(char *token);
+char* expand_variable(const char *var_name);
+void strip_time_prefix(COMMAND *command);
 int check_builtin_command(char *arg0);
-int check_pipe_command(char *cmd);
+int check_copy_command(SIMPLECMD *cmd);
+int check_history_command(COMMAND *command);
+int check_timed_command(COMMAND *command);
+// Redirection
+int apply_redirections(SIMPLECMD *cmd);
+int copy_fd(int in_fd, int out_fd);
+int run_copy_command(SIMPLECMD *cmd);
+// Resource accounting
+double elapsed_seconds(struct timespec *start, struct timespec *end);
+void report_usage(const char *name, double real, struct rusage *usage);
+// Event loop
+void init_event_loop(EVENTLOOP *loop, int handle_signals);
+void reopen_event_loop(EVENTLOOP *loop);
+void reset_child_signals(EVENTLOOP *loop);
+int open_pidfd(pid_t pid);
+int forward_signals(EVENTLOOP *loop, pid_t *pids, int num_pids);
+void wait_children(EVENTLOOP *loop, pid_t *pids, int num_pids, struct rusage *usages, struct timespec *ends);
+int wait_for_input(EVENTLOOP *loop);
+int wait_for_fd(EVENTLOOP *loop, int fd, int timeout_ms);
 // Execution
-void execute_pipeline(char *pipecmd);
-void execute_builtin(char *cmd);
-void execute_single_command(char *cmd);
+void execute_command(COMMAND *command);
+void execute_pipeline(COMMAND *command);
+void execute_builtin(SIMPLECMD *cmd);
+void execute_single_command(SIMPLECMD *cmd, int timed);
+// Parallel batch jobs
+void add_batch_job(BATCHGROUP *group, COMMAND *command, const char *tag);
+int start_batch_job(BATCHJOB *job);
+int wait_batch_jobs(BATCHGROUP *group, int first);
+void flush_batch_job(BATCHJOB *job);
+void run_batch_group(BATCHGROUP *group, int max_jobs);
+// Script cache
+uint64_t hash_bytes(const char *data, size_t len);
+char* read_whole_file(const char *file_name, size_t *size);
+void append_bytes(BYTEBUF *buf, const void *data, size_t len);
+void append_u32(BYTEBUF *buf, uint32_t value);
+uint32_t read_u32(const char *data, size_t *pos);
+void compile_line(BYTEBUF *body, const char *line);
+void compile_script(const char *source, size_t size, BYTEBUF *body);
+int load_script_cache(const char *cache_file, const char *batch_file, struct stat *st, BYTEBUF *body);
+void save_script_cache(const char *cache_file, struct stat *st, uint64_t source_hash, BYTEBUF *body);
+size_t load_compiled_line(const char *data, size_t pos, COMMAND *command);
 // Modes
 void interactive_mode();
 void batch_mode(char *batch_file);
+void cached_batch_mode(char *batch_file);
+void parallel_batch_mode(char *batch_file, int max_jobs);
 
 // Global variables
 HISTORY *history;
 LOCALVARS *local_vars;
+COPROCS *coprocs;
+ARENA *arena;
+EVENTLOOP event_loop;
 
 int main(int argc, char *argv[]) {
     history = init_history();
+    if (getenv(HISTORY_FILE_ENV) != NULL)
+        open_history_file(history, getenv(HISTORY_FILE_ENV));
     local_vars = init_local_vars();
+    coprocs = init_coprocs();
+    arena = init_arena();
+    // Only an interactive shell survives Ctrl-C, a batch run stops on it
+    init_event_loop(&event_loop, argc == 1);
     if (argc == 1) {
         // No arguments, enter interactive mode
         interactive_mode();
     } else if (argc == 2) {
         // One argument, assume it's a batch file and enter batch mode
         batch_mode(argv[1]);
+    } else if (argc == 4 && strcmp(argv[1], "-j") == 0) {
+        // "-j <jobs> <batch file>" runs the batch file on a pool of workers,
+        // "-j 0" uses one worker per online CPU
+        char *end;
+        long max_jobs = strtol(argv[2], &end, 10);
+        if (*argv[2] == '\0' || *end != '\0' || max_jobs < 0) {
+            printf("Usage: ./wsh [-j jobs | -c] [batch file]\n");
+            exit(EXIT_FAILURE);
+        }
+        if (max_jobs == 0)
+            max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        parallel_batch_mode(argv[3], max_jobs > 0 ? (int) max_jobs : 1);
+    } else if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        // "-c <batch file>" runs the batch file from its compiled cache
+        cached_batch_mode(argv[2]);
     } else {
-        // More than one argument is an error
-        printf("Usage: ./wsh [batch file]\n");
+        // Any other argument list is an error
+        printf("Usage: ./wsh [-j jobs | -c] [batch file]\n");
         free_history(history);
         free_local_vars(local_vars);
+        free_coprocs(coprocs);
+        free_arena(arena);
         exit(EXIT_FAILURE);
     }
-    return 0;
+    return 0;
+}
+
+/******************************************************************************
+ * Function related to history
+ *****************************************************************************/
+
+HISTORY* init_history() {
+
+    HISTORY *history = (HISTORY*) malloc(sizeof(HISTORY));
+    history->commands = malloc(DEFAULT_HISTORY_SIZE * sizeof(char *));
+    history->size = 0;
+    history->capacity = DEFAULT_HISTORY_SIZE;
+    history->newest = -1;
+    history->file_name = NULL;
+    history->file = NULL;
+    history->loaded = 1;  // Nothing to load without a history file
+    for (int i = 0; i < DEFAULT_HISTORY_SIZE; i++)
+        history->commands[i] = NULL; // Initialize all commands to NULL
+    return history;
+
+}
+
+void open_history_file(HISTORY *history, const char *file_name) {
+    // Append every new command to file_name. The commands already in the file
+    // are only read when the history is first needed, not at startup.
+
+    FILE *file = fopen(file_name, "a");
+    if (file == NULL) {
+        printf("Error: cannot open history file\n");
+        return;
+    }
+    // Fully buffered: the file is flushed before it is read and at exit
+    setvbuf(file, NULL, _IOFBF, BUFSIZ);
+
+    history->file_name = strdup(file_name);
+    history->file = file;
+    history->loaded = 0;
+
+}
+
+void load_history(HISTORY *history) {
+    // Fill the history from the history file. The file also holds every command
+    // added since startup, so replaying it gives the complete history.
+
+    if (history->loaded)
+        return;
+    history->loaded = 1;
+
+    fflush(history->file);
+    FILE *file = fopen(history->file_name, "r");
+    if (file == NULL)
+        return;
+
+    // Commands added before loading only went to the file
+    char *cmd = NULL;
+    size_t len = 0;
+    while ( getline(&cmd, &len, file) > 0 )
+        push_history(history, cmd);
+
+    free(cmd);
+    fclose(file);
+
+}
+
+void push_history(HISTORY *history, const char *cmd) {
+    // Add a command to the in-memory history only
+
+    // Check if history is disabled
+    if (history->capacity == 0)
+        return;
+
+    // Overwrite the oldest command if the history is full
+    history->newest = (history->newest + 1) % history->capacity;
+    if (history->size >= history->capacity)
+        free(history->commands[history->newest]);
+    else
+        history->size++;  // Increment the size only if the history is not full
+
+    history->commands[history->newest] = strdup(cmd);
+
+}
+
+void add_history(HISTORY *history, const char *cmd) {
+
+    // Check if history is disabled
+    if (history->capacity == 0)
+        return;
+
+    if (history->file != NULL) {
+        fputs(cmd, history->file);
+        // Keep one command per line even if the last line has no newline
+        if (cmd[0] == '\0' || cmd[strlen(cmd) - 1] != '\n')
+            fputc('\n', history->file);
+    }
+
+    // Until the file is loaded, the file alone holds the history
+    if (history->loaded)
+        push_history(history, cmd);
+
+}
+
+void resize_history(HISTORY *history, int new_capacity) {
+
+    load_history(history);
+
+    // Keep the newest commands that fit, oldest first in the new buffer
+    int new_size = history->size < new_capacity ? history->size : new_capacity;
+    char **new_commands = malloc((new_capacity > 0 ? new_capacity : 1) * sizeof(char *));
+    for (int i = 1; i <= history->size; i++) {
+        int index = (history->newest - i + 1 + history->capacity) % history->capacity;
+        if (i <= new_size)
+            new_commands[new_size - i] = history->commands[index];
+        else
+            free(history->commands[index]);
+    }
+
+    // Store the new commands and capacity
+    free(history->commands);
+    history->commands = new_commands;
+    history->capacity = new_capacity;
+    history->size = new_size;
+    history->newest = new_size - 1;
+    
+}
+
+void display_history(HISTORY *history) {
+
+    load_history(history);
+
+    // Index is 1-based and the most recent command is number one
+    for (int i = 1; i <= history->size; i++)
+        printf("%d) %s", i, history->commands[(history->newest - i + 1 + history->capacity) % history->capacity]);
+
+}
+
+void get_history(HISTORY *history, int index, char **cmd) {
+
+    load_history(history);
+
+    if (index < 1 || index > history->size) {
+        printf("Invalid history index\n");
+        *cmd = NULL;
+        return;
+    }
+
+    *cmd = strdup(history->commands[(history->newest - index + 1 + history->capacity) % history->capacity]);
+
+}
+
+void free_history(HISTORY *history) {
+
+    for (int i = 0; i < history->size; i++) {
+        free(history->commands[i]);
+    }
+    free(history->commands);
+    if (history->file != NULL)
+        fclose(history->file);
+    free(history->file_name);
+    history->commands = NULL;
+    history->file = NULL;
+    history->file_name = NULL;
+    history->size = 0;
+    history->capacity = 0;
+    // free(history);
+
+}
+
+/******************************************************************************
+ * Function related to local variables
+ *****************************************************************************/
+
+LOCALVARS* init_local_vars() {
+
+    LOCALVARS *local_vars = (LOCALVARS*) malloc(sizeof(LOCALVARS));
+    local_vars->buckets = calloc(DEFAULT_LOCAL_BUCKETS, sizeof(LOCALVAR *));
+    local_vars->num_buckets = DEFAULT_LOCAL_BUCKETS;
+    local_vars->first = NULL;
+    local_vars->last = NULL;
+    local_vars->num_vars = 0;
+    return local_vars;
+
+}
+
+unsigned int hash_local_var(const char *name) {
+    // FNV-1a hash of the variable name
+
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+
+}
+
+LOCALVAR** find_local_var(LOCALVARS *local_vars, const char *name) {
+    // Return the link that points to the variable in its bucket, or the empty
+    // link at the end of the bucket if the variable does not exist
+
+    unsigned int index = hash_local_var(name) & (local_vars->num_buckets - 1);
+    LOCALVAR **link = &local_vars->buckets[index];
+    while (*link != NULL && strcmp((*link)->name, name) != 0)
+        link = &(*link)->bucket_next;
+    return link;
+
+}
+
+void rehash_local_vars(LOCALVARS *local_vars, int new_num_buckets) {
+
+    LOCALVAR **new_buckets = calloc(new_num_buckets, sizeof(LOCALVAR *));
+    if (new_buckets == NULL)
+        return;  // Keep the old buckets, lookups still work with longer chains
+
+    // Walking in insertion order keeps the bucket chains in insertion order
+    for (LOCALVAR *var = local_vars->last; var != NULL; var = var->prev) {
+        unsigned int index = hash_local_var(var->name) & (new_num_buckets - 1);
+        var->bucket_next = new_buckets[index];
+        new_buckets[index] = var;
+    }
+
+    free(local_vars->buckets);
+    local_vars->buckets = new_buckets;
+    local_vars->num_buckets = new_num_buckets;
+
+}
+
+void add_local_var(LOCALVARS *local_vars, const char *name, const char *value) {
+
+    LOCALVAR **link = find_local_var(local_vars, name);
+    if (*link != NULL) {
+        // Variable already exists, update its value in place
+        free((*link)->value);
+        (*link)->value = strdup(value);
+        return;
+    }
+
+    // Append the new variable to its bucket and to the insertion order
+    LOCALVAR *var = malloc(sizeof(LOCALVAR));
+    var->name = strdup(name);
+    var->value = strdup(value);
+    var->bucket_next = NULL;
+    var->prev = local_vars->last;
+    var->next = NULL;
+    *link = var;
+    if (local_vars->last != NULL)
+        local_vars->last->next = var;
+    else
+        local_vars->first = var;
+    local_vars->last = var;
+    local_vars->num_vars++;
+
+    // Keep the load factor at most one
+    if (local_vars->num_vars > local_vars->num_buckets)
+        rehash_local_vars(local_vars, local_vars->num_buckets * 2);
+
+}
+
+const char* get_local_var(LOCALVARS *local_vars, const char *name) {
+    // The value is owned by the variable store and changes with the variable
+
+    LOCALVAR *var = *find_local_var(local_vars, name);
+    if (var != NULL)
+        return var->value;
+
+    // Return NULL if the variable is not found
+    return NULL;
+
+}
+
+void remove_local_var(LOCALVARS *local_vars, const char *name) {
+
+    LOCALVAR **link = find_local_var(local_vars, name);
+    LOCALVAR *var = *link;
+    if (var == NULL)
+        // Variable not found
+        // printf("Error: variable not found, cannot delete\n");
+        return;
+
+    // Unlink the variable from its bucket and from the insertion order
+    *link = var->bucket_next;
+    if (var->prev != NULL)
+        var->prev->next = var->next;
+    else
+        local_vars->first = var->next;
+    if (var->next != NULL)
+        var->next->prev = var->prev;
+    else
+        local_vars->last = var->prev;
+    local_vars->num_vars--;
+
+    free(var->name);
+    free(var->value);
+    free(var);
+
+}
+
+void display_local_vars(LOCALVARS *local_vars) {
+
+    for (LOCALVAR *var = local_vars->first; var != NULL; var = var->next)
+        printf("%s=%s\n", var->name, var->value);
+
+}
+
+void free_local_vars(LOCALVARS *local_vars) {
+
+    LOCALVAR *var = local_vars->first;
+    while (var != NULL) {
+        LOCALVAR *next = var->next;
+        free(var->name);
+        free(var->value);
+        free(var);
+        var = next;
+    }
+    free(local_vars->buckets);
+    local_vars->buckets = NULL;
+    local_vars->num_buckets = 0;
+    local_vars->first = NULL;
+    local_vars->last = NULL;
+    local_vars->num_vars = 0;
+    // free(local_vars);
+
+}
+
+/******************************************************************************
+ * Function related to coprocesses
+ *
+ * A coprocess is a long-lived worker connected to the shell by two pipes.
+ * "coproc send" writes one request line to its stdin and prints one response
+ * line from its stdout, so repeated requests do not pay for fork and exec.
+ * The worker must answer every line with one line and flush its output,
+ * e.g. "bc -q" or "sed -u s/a/b/". A worker that does not answer within
+ * COPROC_TIMEOUT_MS is reported instead of blocking the shell.
+ *****************************************************************************/
+
+COPROCS* init_coprocs() {
+
+    COPROCS *coprocs = (COPROCS*) malloc(sizeof(COPROCS));
+    coprocs->procs = NULL;
+    coprocs->capacity = 0;
+    coprocs->size = 0;
+    return coprocs;
+
+}
+
+COPROC* find_coproc(COPROCS *coprocs, const char *name) {
+
+    for (int i = 0; i < coprocs->size; i++)
+        if (strcmp(coprocs->procs[i].name, name) == 0)
+            return &coprocs->procs[i];
+    return NULL;
+
+}
+
+void start_coproc(COPROCS *coprocs, const char *name, char **argv) {
+
+    if (find_coproc(coprocs, name) != NULL) {
+        printf("Error: coprocess %s already exists\n", name);
+        return;
+    }
+
+    // The shell's ends are close-on-exec so that no other child inherits them
+    int to_fds[2], from_fds[2];
+    if (pipe2(to_fds, O_CLOEXEC) < 0) {
+        printf("Error: pipe() fails\n");
+        return;
+    }
+    if (pipe2(from_fds, O_CLOEXEC) < 0) {
+        printf("Error: pipe() fails\n");
+        close(to_fds[0]);
+        close(to_fds[1]);
+        return;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // Child process, dup2() clears close-on-exec on stdin and stdout
+        reset_child_signals(&event_loop);
+        dup2(to_fds[0], STDIN_FILENO);
+        dup2(from_fds[1], STDOUT_FILENO);
+        execvp(argv[0], argv);
+        // stdout is the response pipe, so report on stderr
+        fprintf(stderr, "execvp: No such file or directory\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(to_fds[0]);
+    close(from_fds[1]);
+    if (pid < 0) {
+        printf("Error: fork() fails\n");
+        close(to_fds[1]);
+        close(from_fds[0]);
+        return;
+    }
+
+    // Grow the array if it is full
+    if (coprocs->size >= coprocs->capacity) {
+        coprocs->capacity = coprocs->capacity > 0 ? coprocs->capacity * 2 : 4;
+        coprocs->procs = realloc(coprocs->procs, coprocs->capacity * sizeof(COPROC));
+    }
+
+    COPROC *coproc = &coprocs->procs[coprocs->size++];
+    coproc->name = strdup(name);
+    coproc->pid = pid;
+    coproc->to = fdopen(to_fds[1], "w");
+    coproc->from = from_fds[0];
+
+}
+
+void send_coproc(COPROCS *coprocs, const char *name, char **words, int num_words) {
+
+    COPROC *coproc = find_coproc(coprocs, name);
+    if (coproc == NULL) {
+        printf("Error: no coprocess named %s\n", name);
+        return;
+    }
+
+    // Drop whatever a worker answered after an earlier request timed out,
+    // so that its late answer is not taken for this one
+    char c;
+    while (wait_for_fd(&event_loop, coproc->from, 0) > 0 && read(coproc->from, &c, 1) == 1)
+        ;
+
+    // Send the words as one line. A worker that has exited must not kill
+    // the shell with SIGPIPE.
+    void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < num_words; i++)
+        fprintf(coproc->to, i > 0 ? " %s" : "%s", words[i]);
+    fputc('\n', coproc->to);
+    int failed = fflush(coproc->to) != 0;
+    signal(SIGPIPE, old_handler);
+
+    // Read one line of response a byte at a time, so nothing after the
+    // newline is taken from the pipe, and give up at the deadline
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *response = malloc(MAX_LINE);
+    size_t len = 0, capacity = MAX_LINE;
+    int ready = 1;
+    while (!failed) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = COPROC_TIMEOUT_MS - (int) (elapsed_seconds(&start, &now) * 1000);
+        if ( (ready = wait_for_fd(&event_loop, coproc->from, left > 0 ? left : 0)) <= 0 )
+            break;
+        if (read(coproc->from, &c, 1) != 1) {
+            failed = 1;
+            break;
+        }
+        if (len + 2 > capacity)
+            response = realloc(response, capacity *= 2);
+        response[len++] = c;
+        if (c == '\n')
+            break;
+    }
+    response[len] = '\0';
+
+    if (failed)
+        printf("Error: coprocess %s exited\n", name);
+    else if (ready == 0)
+        printf("Error: coprocess %s did not respond\n", name);
+    else if (ready < 0)
+        printf("Error: coprocess %s interrupted\n", name);
+    else
+        printf("%s", response);
+    free(response);
+
+}
+
+void stop_coproc(COPROCS *coprocs, const char *name) {
+
+    COPROC *coproc = find_coproc(coprocs, name);
+    if (coproc == NULL) {
+        printf("Error: no coprocess named %s\n", name);
+        return;
+    }
+
+    // Closing its stdin tells the worker to exit, one that does not is
+    // terminated after COPROC_TIMEOUT_MS
+    fclose(coproc->to);
+    close(coproc->from);
+    int pidfd = open_pidfd(coproc->pid);
+    if (pidfd >= 0) {
+        if (wait_for_fd(&event_loop, pidfd, COPROC_TIMEOUT_MS) <= 0)
+            kill(coproc->pid, SIGTERM);
+        close(pidfd);
+    }
+    waitpid(coproc->pid, NULL, 0);
+    free(coproc->name);
+
+    // Move the last coprocess into the free slot
+    *coproc = coprocs->procs[--coprocs->size];
+
+}
+
+void display_coprocs(COPROCS *coprocs) {
+
+    for (int i = 0; i < coprocs->size; i++)
+        printf("%s %d\n", coprocs->procs[i].name, (int) coprocs->procs[i].pid);
+
+}
+
+void free_coprocs(COPROCS *coprocs) {
+
+    while (coprocs->size > 0)
+        stop_coproc(coprocs, coprocs->procs[0].name);
+    free(coprocs->procs);
+    coprocs->procs = NULL;
+    coprocs->capacity = 0;
+    // free(coprocs);
+
+}
+
+/******************************************************************************
+ * Functions related to the line arena
+ *****************************************************************************/
+
+ARENA* init_arena() {
+
+    ARENA *arena = (ARENA*) malloc(sizeof(ARENA));
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->last = NULL;
+    return arena;
+
+}
+
+void* arena_alloc(ARENA *arena, size_t size) {
+    // Return size bytes from the arena. The memory stays valid until the next
+    // reset_arena() and is never freed on its own.
+
+    // Keep every allocation pointer-aligned
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    // Find a block with enough room, starting from the current one
+    ARENABLOCK *block = arena->current;
+    while (block != NULL && block->used + size > block->size)
+        block = block->next;
+
+    // Append a new block if none is large enough
+    if (block == NULL) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ARENABLOCK) + block_size);
+        if (block == NULL) {
+            printf("Error: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+        if (arena->last != NULL)
+            arena->last->next = block;
+        else
+            arena->first = block;
+        arena->last = block;
+    }
+
+    arena->current = block;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+
+}
+
+char* arena_strdup(ARENA *arena, const char *str) {
+
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+
+}
+
+void reset_arena(ARENA *arena) {
+
+    // Keep the blocks for the next line, only mark them as empty
+    for (ARENABLOCK *block = arena->first; block != NULL; block = block->next)
+        block->used = 0;
+    arena->current = arena->first;
+
+}
+
+void free_arena(ARENA *arena) {
+
+    ARENABLOCK *block = arena->first;
+    while (block != NULL) {
+        ARENABLOCK *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->last = NULL;
+    // free(arena);
+
+}
+
+/******************************************************************************
+ * Functions for parsing and checking
+ *****************************************************************************/
+
+int parse_command_line(const char *line, COMMAND *command) {
+    // Parse the input line into a pipeline of simple commands. Everything is
+    // allocated in the arena, so the command is valid until the next
+    // reset_arena(). Return the number of non-empty commands, or 0 if the
+    // line has a syntax error.
+
+    command->line = arena_strdup(arena, line);
+    char *buf = arena_strdup(arena, line);
+
+    // Count the pipeline stages to size the command array
+    int max_cmds = 1;
+    for (char *c = buf; *c != '\0'; c++)
+        if (*c == '|')
+            max_cmds++;
+    command->pipeline = max_cmds > 1;
+    command->timed = 0;
+    command->cmds = arena_alloc(arena, max_cmds * sizeof(SIMPLECMD));
+    command->num_cmds = 0;
+
+    char *stage;
+    while ( (stage = strsep(&buf, "|")) != NULL ) {
+        int argc = parse_single_command(stage, &command->cmds[command->num_cmds]);
+        if (argc < 0)
+            return command->num_cmds = 0;
+        // Skip empty stages
+        if (argc > 0)
+            command->num_cmds++;
+    }
+
+    strip_time_prefix(command);
+
+    return command->num_cmds;
+
+}
+
+int parse_single_command(char *stage, SIMPLECMD *cmd) {
+    // Split one pipeline stage into arguments in place, replace local
+    // variables and collect redirections. Return the number of arguments,
+    // or -1 on a syntax error.
+
+    // Count the tokens to size the argument array
+    int max_args = 0;
+    int in_token = 0;
+    for (char *c = stage; *c != '\0'; c++) {
+        if (*c == ' ' || *c == '\t' || *c == '\n')
+            in_token = 0;
+        else if (!in_token) {
+            in_token = 1;
+            max_args++;
+        }
+    }
+    init_single_command(cmd, max_args);
+
+    char *token;
+    TOKENKIND kind;
+    while ( (kind = next_token(&stage, &token)) != TOKEN_END )
+        if (kind == TOKEN_ERROR || add_token(cmd, kind, expand_token(token)) < 0) {
+            printf("Error: missing file name for redirection\n");
+            return -1;
+        }
+
+    return cmd->argc;
+
+}
+
+void init_single_command(SIMPLECMD *cmd, int max_args) {
+
+    cmd->argv = arena_alloc(arena, (max_args + 1) * sizeof(char *));  // +1 for NULL-terminator
+    cmd->argv[0] = NULL;
+    cmd->argc = 0;
+    cmd->redirs = arena_alloc(arena, (max_args > 0 ? max_args : 1) * sizeof(REDIRECT));
+    cmd->num_redirs = 0;
+
+}
+
+TOKENKIND next_token(char **stage, char **token) {
+    // Split the next token off *stage. Redirections are "2>&1", "<file",
+    // ">file" and ">>file", with or without a space before the file name, and
+    // *token is set to the file name. Return the kind of the token.
+
+    char *text;
+    while ( (text = strsep(stage, " \t\n")) != NULL && strlen(text) == 0 )
+        ;
+    if (text == NULL)
+        return TOKEN_END;
+
+    *token = text;
+    if (strcmp(text, "2>&1") == 0)
+        return TOKEN_ERROR_TO_OUTPUT;
+    if (text[0] != '<' && text[0] != '>')
+        return TOKEN_ARG;
+
+    TOKENKIND kind = text[0] == '<' ? TOKEN_INPUT
+                   : strncmp(text, ">>", 2) == 0 ? TOKEN_APPEND : TOKEN_OUTPUT;
+    char *file = text + (kind == TOKEN_APPEND ? 2 : 1);
+    // The file name is the next token
+    while (*file == '\0' && (file = strsep(stage, " \t\n")) != NULL)
+        ;
+    if (file == NULL)
+        return TOKEN_ERROR;
+    *token = file;
+    return kind;
+
+}
+
+int add_token(SIMPLECMD *cmd, TOKENKIND kind, char *value) {
+    // Add an expanded token to the command, value is NULL if it named a
+    // variable that does not exist. Return -1 if a redirection has no file.
+
+    switch (kind) {
+        case TOKEN_ARG:
+            // Variable does not exist, so leave this argument out
+            if (value != NULL) {
+                cmd->argv[cmd->argc++] = value;
+                cmd->argv[cmd->argc] = NULL;
+            }
+            return 0;
+        case TOKEN_ERROR_TO_OUTPUT:
+            cmd->redirs[cmd->num_redirs].kind = kind;
+            cmd->redirs[cmd->num_redirs++].file = NULL;
+            return 0;
+        case TOKEN_INPUT:
+        case TOKEN_OUTPUT:
+        case TOKEN_APPEND:
+            if (value == NULL)
+                return -1;
+            cmd->redirs[cmd->num_redirs].kind = kind;
+            cmd->redirs[cmd->num_redirs++].file = value;
+            return 0;
+        default:
+            return -1;
+    }
+
+}
+
+char* expand_token(char *token) {
+    // Replace a "$name" token with the value of the variable. Return the token
+    // itself if it is not a variable, or NULL if the variable does not exist.
+
+    if (token[0] != '$')
+        return token;
+
+    return expand_variable(token + 1);  // Skip the dollar sign
+
+}
+
+char* expand_variable(const char *var_name) {
+    // Return an arena copy of the variable's value, or NULL if it is not set
+
+    // environment variable has higher priority
+    const char *var_value = getenv(var_name);
+    if (var_value == NULL)
+        var_value = get_local_var(local_vars, var_name);
+    if (var_value == NULL)
+        return NULL;
+    return arena_strdup(arena, var_value);
+
+}
+
+void strip_time_prefix(COMMAND *command) {
+    // "time" is not a stage of its own, it applies to the whole line
+
+    if (command->num_cmds > 0 && strcmp(command->cmds[0].argv[0], TIME_COMMAND) == 0) {
+        command->timed = 1;
+        command->cmds[0].argv++;
+        if (--command->cmds[0].argc == 0) {
+            command->cmds++;
+            command->num_cmds--;
+        }
+    }
+
+}
+
+int check_builtin_command(char *arg0) {
+    // Return 1 if the command is a built-in command, 0 otherwise
+
+    if (   strcmp(arg0, "exit")     == 0 
+        || strcmp(arg0, "cd")       == 0
+        || strcmp(arg0, "export")   == 0
+        || strcmp(arg0, "local")    == 0
+        || strcmp(arg0, "vars")     == 0
+        || strcmp(arg0, "history")  == 0
+        || strcmp(arg0, "coproc")   == 0
+    )
+        return 1;
+
+    return 0;
+
+}
+
+int check_copy_command(SIMPLECMD *cmd) {
+    // Return 1 if the command only copies its input or one file to its output
+    // ("cat" or "cat <file>"), so the copy helper can run it, 0 otherwise
+
+    return strcmp(cmd->argv[0], COPY_COMMAND) == 0
+        && (cmd->argc == 1 || (cmd->argc == 2 && cmd->argv[1][0] != '-'));
+
+}
+
+int check_timed_command(COMMAND *command) {
+    // Return 1 if resource usage of the command should be reported, 0 otherwise
+
+    return command->timed || getenv(TIMING_ENV) != NULL;
+
+}
+
+int check_history_command(COMMAND *command) {
+    // Return 1 if the command should be added to history, 0 otherwise.
+    // Built-in commands are not added, but pipelines always are.
+
+    return command->pipeline || !check_builtin_command(command->cmds[0].argv[0]);
+
+}
+
+/******************************************************************************
+ * Functions for parallel batch jobs
+ *****************************************************************************/
+
+void add_batch_job(BATCHGROUP *group, COMMAND *command, const char *tag) {
+
+    // Grow the job array if it is full
+    if (group->size >= group->capacity) {
+        group->capacity = group->capacity > 0 ? group->capacity * 2 : 16;
+        group->jobs = realloc(group->jobs, group->capacity * sizeof(BATCHJOB));
+    }
+
+    BATCHJOB *job = &group->jobs[group->size];
+    job->command = *command;
+    job->tag = tag != NULL ? arena_strdup(arena, tag) : NULL;
+    job->after = -1;
+    job->pid = -1;
+    job->pidfd = -1;
+    job->output = NULL;
+    job->errors = NULL;
+    job->state = JOB_PENDING;
+
+    // A tagged job depends on the previous job with the same tag
+    if (tag != NULL)
+        for (int i = group->size - 1; i >= 0; i--)
+            if (group->jobs[i].tag != NULL && strcmp(group->jobs[i].tag, tag) == 0) {
+                job->after = i;
+                break;
+            }
+
+    group->size++;
+
+}
+
+int start_batch_job(BATCHJOB *job) {
+    // Fork a worker that runs the job with its stdout and stderr captured in
+    // two temporary files. Return 0 on success, -1 on failure.
+
+    job->output = tmpfile();
+    job->errors = tmpfile();
+    if (job->output == NULL || job->errors == NULL) {
+        printf("Error: cannot capture command output\n");
+        if (job->output != NULL)
+            fclose(job->output);
+        if (job->errors != NULL)
+            fclose(job->errors);
+        job->output = job->errors = NULL;
+        return -1;
+    }
+
+    // Flush pending output so that the worker does not print it again
+    fflush(stdout);
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // Worker process
+        reopen_event_loop(&event_loop);
+        dup2(fileno(job->output), STDOUT_FILENO);
+        dup2(fileno(job->errors), STDERR_FILENO);
+        if (job->command.pipeline)
+            execute_pipeline(&job->command);
+        else
+            execute_single_command(&job->command.cmds[0], check_timed_command(&job->command));
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+    else if (pid < 0) {
+        // Fork failed
+        printf("Error: fork() fails\n");
+        fclose(job->output);
+        fclose(job->errors);
+        job->output = job->errors = NULL;
+        return -1;
+    }
+
+    job->pid = pid;
+    job->state = JOB_RUNNING;
+
+    // Watch the worker through a pidfd, so that waiting for it never reaps
+    // other children of the shell such as coprocesses
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = (uint64_t) pid };
+    if (event_loop.epoll_fd >= 0)
+        job->pidfd = open_pidfd(pid);
+    if (job->pidfd >= 0 && epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_ADD, job->pidfd, &event) < 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+    return 0;
+
+}
+
+int wait_batch_jobs(BATCHGROUP *group, int first) {
+    // Wait until a running job from index first on has finished and mark
+    // every finished job done. Only the workers are reaped. Return the
+    // number of jobs that finished.
+
+    int finished = 0;
+
+    while (finished == 0) {
+        // A worker without a pidfd can only be waited for directly
+        int block = -1;
+        for (int i = first; i < group->size && block < 0; i++)
+            if (group->jobs[i].state == JOB_RUNNING && group->jobs[i].pidfd < 0)
+                block = i;
+
+        if (block < 0) {
+            struct epoll_event events[MAX_EVENTS];
+            if (epoll_wait(event_loop.epoll_fd, events, MAX_EVENTS, -1) < 0 && errno != EINTR)
+                for (int i = first; i < group->size && block < 0; i++)
+                    if (group->jobs[i].state == JOB_RUNNING)
+                        block = i;
+        }
+
+        for (int i = first; i < group->size; i++) {
+            BATCHJOB *job = &group->jobs[i];
+            if (job->state != JOB_RUNNING)
+                continue;
+            pid_t pid = waitpid(job->pid, NULL, i == block ? 0 : WNOHANG);
+            if (pid == 0 || (pid < 0 && errno == EINTR))
+                continue;
+            if (job->pidfd >= 0) {
+                epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, job->pidfd, NULL);
+                close(job->pidfd);
+                job->pidfd = -1;
+            }
+            job->state = JOB_DONE;
+            finished++;
+        }
+    }
+
+    return finished;
+
+}
+
+void flush_batch_job(BATCHJOB *job) {
+    // Print what the worker wrote, each stream to where it was headed
+
+    FILE *captured[2] = { job->output, job->errors };
+    FILE *streams[2] = { stdout, stderr };
+
+    for (int i = 0; i < 2; i++) {
+        if (captured[i] == NULL)
+            continue;
+        char buf[4096];
+        size_t n;
+        // The worker wrote through a shared offset, so start from the beginning
+        rewind(captured[i]);
+        while ( (n = fread(buf, 1, sizeof(buf), captured[i])) > 0 )
+            fwrite(buf, 1, n, streams[i]);
+        fflush(streams[i]);
+        fclose(captured[i]);
+    }
+
+    job->output = job->errors = NULL;
+
+}
+
+void run_batch_group(BATCHGROUP *group, int max_jobs) {
+    // Run all jobs of the group on at most max_jobs workers and print their
+    // output in script order. Return when every job has finished.
+
+    int running = 0;                                // Number of busy workers
+    int next_start = 0;                             // First job that may still be pending
+    int next_flush = 0;                             // First job whose output is not printed
+
+    while (next_flush < group->size) {
+
+        // Start runnable jobs while there are idle workers
+        while (next_start < group->size && group->jobs[next_start].state != JOB_PENDING)
+            next_start++;
+        for (int i = next_start; i < group->size && running < max_jobs; i++) {
+            BATCHJOB *job = &group->jobs[i];
+            if (job->state != JOB_PENDING)
+                continue;
+            if (job->after >= 0 && group->jobs[job->after].state != JOB_DONE)
+                continue;
+            if (start_batch_job(job) == 0)
+                running++;
+            else
+                job->state = JOB_DONE;
+        }
+
+        // Wait for any worker to finish
+        if (running > 0)
+            running -= wait_batch_jobs(group, next_flush);
+
+        // Print finished jobs in script order
+        while (next_flush < group->size && group->jobs[next_flush].state == JOB_DONE)
+            flush_batch_job(&group->jobs[next_flush++]);
+
+    }
+
+    group->size = 0;
+
+}
+
+/******************************************************************************
+ * Functions for redirection
+ *****************************************************************************/
+
+int apply_redirections(SIMPLECMD *cmd) {
+    // Point stdin, stdout and stderr at the files named by the command, left
+    // to right like a POSIX shell, so "2>&1 >file" leaves stderr where stdout
+    // was. Return 0 on success, -1 if a file cannot be opened.
+
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        REDIRECT *redir = &cmd->redirs[i];
+        if (redir->kind == TOKEN_ERROR_TO_OUTPUT) {
+            dup2(STDOUT_FILENO, STDERR_FILENO);
+            continue;
+        }
+
+        int target = redir->kind == TOKEN_INPUT ? STDIN_FILENO : STDOUT_FILENO;
+        int flags = redir->kind == TOKEN_INPUT ? O_RDONLY
+                  : O_WRONLY | O_CREAT | (redir->kind == TOKEN_APPEND ? O_APPEND : O_TRUNC);
+        int fd = open(redir->file, flags, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Error: cannot open %s\n", redir->file);
+            return -1;
+        }
+        dup2(fd, target);
+        close(fd);
+    }
+
+    return 0;
+
+}
+
+int copy_fd(int in_fd, int out_fd) {
+    // Copy everything from in_fd to out_fd. The data stays in the kernel when
+    // possible: copy_file_range() between files, splice() when either end is
+    // a pipe, and read()/write() otherwise. Each method continues from the
+    // offsets left by the previous one. Return 0 on success, -1 on error.
+
+    ssize_t n;
+
+    while ( (n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0)) > 0 )
+        ;
+    if (n == 0)
+        return 0;
+
+    while ( (n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE)) > 0 )
+        ;
+    if (n == 0)
+        return 0;
+
+    char buf[4096];
+    while ( (n = read(in_fd, buf, sizeof(buf))) > 0 )
+        for (ssize_t written = 0, w; written < n; written += w)
+            if ( (w = write(out_fd, buf + written, n - written)) < 0 )
+                return -1;
+
+    return n == 0 ? 0 : -1;
+
+}
+
+int run_copy_command(SIMPLECMD *cmd) {
+    // Run "cat" or "cat <file>" in the current process with copy_fd().
+    // Return the exit status.
+
+    int in_fd = STDIN_FILENO;
+    if (cmd->argc == 2) {
+        in_fd = open(cmd->argv[1], O_RDONLY);
+        if (in_fd < 0) {
+            fprintf(stderr, "%s: %s: No such file or directory\n", cmd->argv[0], cmd->argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int rc = copy_fd(in_fd, STDOUT_FILENO) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (in_fd != STDIN_FILENO)
+        close(in_fd);
+    return rc;
+
 }
 
 /******************************************************************************
- * Function related to history
+ * Functions for resource accounting
  *****************************************************************************/
 
-HISTORY* init_history() {
+double elapsed_seconds(struct timespec *start, struct timespec *end) {
 
-    HISTORY *history = (HISTORY*) malloc(sizeof(HISTORY));
-    history->commands = malloc(DEFAULT_HISTORY_SIZE * sizeof(char *));
-    history->size = 0;
-    history->capacity = DEFAULT_HISTORY_SIZE;
-    for (int i = 0; i < DEFAULT_HISTORY_SIZE; i++)
-        history->commands[i] = NULL; // Initialize all commands to NULL
-    return history;
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
 
 }
 
-void add_history(HISTORY *history, const char *cmd) {
+void report_usage(const char *name, double real, struct rusage *usage) {
+    // Print one line of resource usage to stderr, so that it never mixes
+    // with the output of the command
 
-    // Check if history is disabled
-    if (history->capacity == 0)
-        return;
+    fprintf(stderr, "%s: real %.3fs user %.3fs sys %.3fs maxrss %ldKB csw %ld/%ld\n",
+            name, real,
+            usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+            usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+            usage->ru_maxrss,
+            usage->ru_nvcsw,     // Voluntary context switches
+            usage->ru_nivcsw);   // Involuntary context switches
 
-    // Free the oldest command if the history is full
-    if (history->size >= history->capacity)
-        free(history->commands[history->capacity - 1]);
-    else
-        history->size++;  // Increment the size only if the history is not full
+}
+
+/******************************************************************************
+ * Functions for the script cache
+ *
+ * "wsh -c script.wsh" keeps the compiled form of the script in "script.wshc":
+ * a SCRIPTHEADER followed by one record per non-empty line,
+ *
+ *   u32 length, line text with its NUL
+ *   u8  flags (SCRIPT_LINE_*)
+ *   u32 number of stages, then for each stage:
+ *       u32 number of tokens, then for each token:
+ *           u8 TOKENKIND, or'ed with SCRIPT_TOKEN_VARIABLE for "$name"
+ *           u32 length, token text with its NUL
+ *
+ * Variables are left as slots and filled in when the line runs. The cache is
+ * used while the script's mtime and size match, or its contents hash the
+ * same; otherwise the script is compiled again.
+ *****************************************************************************/
 
-    // Move all commands to the right
-    memmove(history->commands + 1, history->commands, (history->size - 1) * sizeof(char *));
+uint64_t hash_bytes(const char *data, size_t len) {
+    // 64-bit FNV-1a hash
 
-    // Add the new command to the first position
-    history->commands[0] = strdup(cmd);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
 
 }
 
-void resize_history(HISTORY *history, int new_capacity) {
+char* read_whole_file(const char *file_name, size_t *size) {
+    // Return the malloc'ed contents of the file, NUL-terminated, or NULL
 
-    // If the history size is larger than the new capacity, free the oldest commands
-    if (history->size > new_capacity) {
-        for (int i = new_capacity; i < history->size; i++)
-            free(history->commands[i]);
-        history->size = new_capacity;
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL)
+        return NULL;
+
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fileno(file), &st) == 0 && (data = malloc(st.st_size + 1)) != NULL) {
+        *size = fread(data, 1, st.st_size, file);
+        data[*size] = '\0';
     }
-    
-    // Resize the history to the new capacity. Note that newest commands are at
-    // the beginning of the array, so trunations should be fine.
-    char **new_commands = realloc(history->commands, new_capacity * sizeof(char *));
+    fclose(file);
+    return data;
+
+}
 
-    // Note: this is not needed, as the stupid test code tests set history size to 0
-    // // Handle allocation failure
-    // if (new_commands == NULL) {
-    //     printf("Failed to resize history\n");
-    //     exit(EXIT_FAILURE);
-    // }
+void append_bytes(BYTEBUF *buf, const void *data, size_t len) {
+
+    // Grow the buffer if it is full
+    if (buf->size + len > buf->capacity) {
+        while (buf->size + len > buf->capacity)
+            buf->capacity = buf->capacity > 0 ? buf->capacity * 2 : 4096;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
 
-    // Store the new commands and capacity
-    history->commands = new_commands;
-    history->capacity = new_capacity;
-    
 }
 
-void display_history(HISTORY *history) {
+void append_u32(BYTEBUF *buf, uint32_t value) {
 
-    //printf("history size%d\n", history->size);
+    append_bytes(buf, &value, sizeof(value));
 
-    for (int i = 0; i < history->size; i++)
-        // Index is 1-based, so we add 1 to i
-        printf("%d) %s", i + 1, history->commands[i]);
+}
+
+uint32_t read_u32(const char *data, size_t *pos) {
+
+    uint32_t value;
+    memcpy(&value, data + *pos, sizeof(value));
+    *pos += sizeof(value);
+    return value;
 
 }
 
-void get_history(HISTORY *history, int index, char **cmd) {
+void compile_line(BYTEBUF *body, const char *line) {
+    // Append the record of one line to body. Lines without tokens are left out.
+
+    size_t record = body->size;
+    uint32_t len = strlen(line) + 1;
+    append_u32(body, len);
+    append_bytes(body, line, len);
+
+    char *buf = arena_strdup(arena, line);
+    uint8_t flags = strchr(buf, '|') != NULL ? SCRIPT_LINE_PIPELINE : 0;
+    size_t flags_pos = body->size;
+    append_bytes(body, &flags, 1);
+
+    // Stage and token counts are patched in once they are known
+    size_t num_stages_pos = body->size;
+    uint32_t num_stages = 0;
+    uint32_t total_tokens = 0;
+    append_u32(body, 0);
+
+    char *stage;
+    while ( (stage = strsep(&buf, "|")) != NULL ) {
+        size_t num_tokens_pos = body->size;
+        uint32_t num_tokens = 0;
+        append_u32(body, 0);
+
+        char *token;
+        TOKENKIND kind;
+        while ( (kind = next_token(&stage, &token)) != TOKEN_END ) {
+            if (kind == TOKEN_ERROR) {
+                // Keep only the line text and report the error when it runs
+                body->size = flags_pos;
+                flags = SCRIPT_LINE_REPARSE;
+                append_bytes(body, &flags, 1);
+                return;
+            }
+            uint8_t tag = kind;
+            if (token[0] == '$') {
+                tag |= SCRIPT_TOKEN_VARIABLE;
+                token++;  // Store the name without the dollar sign
+            }
+            uint32_t token_len = strlen(token) + 1;
+            append_bytes(body, &tag, 1);
+            append_u32(body, token_len);
+            append_bytes(body, token, token_len);
+            num_tokens++;
+        }
 
-    if (index < 1 || index > history->size) {
-        printf("Invalid history index\n");
-        *cmd = NULL;
-        return;
+        memcpy(body->data + num_tokens_pos, &num_tokens, sizeof(num_tokens));
+        total_tokens += num_tokens;
+        num_stages++;
     }
 
-    *cmd = strdup(history->commands[index - 1]);
+    memcpy(body->data + num_stages_pos, &num_stages, sizeof(num_stages));
+    if (total_tokens == 0)
+        body->size = record;
 
 }
 
-void free_history(HISTORY *history) {
-
-    for (int i = 0; i < history->size; i++) {
-        free(history->commands[i]);
+void compile_script(const char *source, size_t size, BYTEBUF *body) {
+
+    const char *end = source + size;
+    while (source < end) {
+        // Each record keeps the newline, like lines read with getline()
+        const char *newline = memchr(source, '\n', end - source);
+        size_t len = newline != NULL ? (size_t) (newline - source) + 1 : (size_t) (end - source);
+        char *line = arena_alloc(arena, len + 1);
+        memcpy(line, source, len);
+        line[len] = '\0';
+        compile_line(body, line);
+        reset_arena(arena);
+        source += len;
     }
-    free(history->commands);
-    history->commands = NULL;
-    history->size = 0;
-    history->capacity = 0;
-    // free(history);
 
 }
 
-/******************************************************************************
- * Function related to local variables
- *****************************************************************************/
+int load_script_cache(const char *cache_file, const char *batch_file, struct stat *st, BYTEBUF *body) {
+    // Load the compiled lines of the batch file into body. Return 0 if the
+    // cache is valid for the batch file, -1 otherwise.
 
-LOCALVARS* init_local_vars() {
+    size_t size;
+    char *data = read_whole_file(cache_file, &size);
+    if (data == NULL)
+        return -1;
 
-    LOCALVARS *local_vars = (LOCALVARS*) malloc(sizeof(LOCALVARS));
-    local_vars->var_name = malloc(MAX_LOCAL_VARIABLES * sizeof(char *));
-    local_vars->var_value = malloc(MAX_LOCAL_VARIABLES * sizeof(char *));
-    local_vars->num_vars = 0;
-    for (int i = 0; i < MAX_LOCAL_VARIABLES; i++) {
-        local_vars->var_name[i] = NULL;
-        local_vars->var_value[i] = NULL;
+    SCRIPTHEADER header;
+    if (size < sizeof(header)) {
+        free(data);
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (   header.magic != SCRIPT_CACHE_MAGIC
+        || header.version != SCRIPT_CACHE_VERSION
+        || header.body_size != size - sizeof(header)
+        || header.body_hash != hash_bytes(data + sizeof(header), header.body_size)
+    ) {
+        free(data);
+        return -1;
+    }
+
+    // A touched but unchanged script still uses the cache
+    if (   header.source_mtime_sec != st->st_mtim.tv_sec
+        || header.source_mtime_nsec != st->st_mtim.tv_nsec
+        || header.source_size != st->st_size
+    ) {
+        size_t source_size;
+        char *source = read_whole_file(batch_file, &source_size);
+        int same = source != NULL && hash_bytes(source, source_size) == header.source_hash;
+        free(source);
+        if (!same) {
+            free(data);
+            return -1;
+        }
     }
-    return local_vars;
+
+    // The body is the rest of the file
+    memmove(data, data + sizeof(header), header.body_size);
+    body->data = data;
+    body->size = header.body_size;
+    body->capacity = size;
+
+    // Record the new mtime so that the next run skips hashing
+    if (header.source_mtime_sec != st->st_mtim.tv_sec || header.source_mtime_nsec != st->st_mtim.tv_nsec)
+        save_script_cache(cache_file, st, header.source_hash, body);
+
+    return 0;
 
 }
 
-void add_local_var(LOCALVARS *local_vars, const char *name, const char *value) {
+void save_script_cache(const char *cache_file, struct stat *st, uint64_t source_hash, BYTEBUF *body) {
+    // Write the cache to a temporary file and rename it over the old cache, so
+    // that a concurrent run never reads a partial cache. The cache is only an
+    // optimization, so failures are ignored.
+
+    SCRIPTHEADER header = {
+        SCRIPT_CACHE_MAGIC, SCRIPT_CACHE_VERSION,
+        st->st_mtim.tv_sec, st->st_mtim.tv_nsec, st->st_size, source_hash,
+        body->size, hash_bytes(body->data, body->size)
+    };
+
+    char tmp_file[strlen(cache_file) + 16];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.%d", cache_file, (int) getpid());
+    FILE *file = fopen(tmp_file, "w");
+    if (file == NULL)
+        return;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1
+          && fwrite(body->data, 1, body->size, file) == body->size;
+    if (fclose(file) == 0 && ok)
+        rename(tmp_file, cache_file);
+    else
+        unlink(tmp_file);
 
-    for (int i = 0; i < local_vars->num_vars; i++)
-        if (strcmp(local_vars->var_name[i], name) == 0) {
-            // Variable already exists, update its value
-            free(local_vars->var_value[i]);
-            local_vars->var_value[i] = strdup(value);
-            return;
+}
+
+size_t load_compiled_line(const char *data, size_t pos, COMMAND *command) {
+    // Build the command of the record at pos, filling in variable slots.
+    // Return the position of the next record.
+
+    uint32_t len = read_u32(data, &pos);
+    const char *line = data + pos;
+    pos += len;
+    uint8_t flags = data[pos++];
+
+    if (flags & SCRIPT_LINE_REPARSE) {
+        parse_command_line(line, command);
+        return pos;
+    }
+
+    uint32_t num_stages = read_u32(data, &pos);
+    command->line = (char *) line;
+    command->pipeline = (flags & SCRIPT_LINE_PIPELINE) != 0;
+    command->timed = 0;
+    command->cmds = arena_alloc(arena, num_stages * sizeof(SIMPLECMD));
+    command->num_cmds = 0;
+
+    int failed = 0;
+    for (uint32_t i = 0; i < num_stages; i++) {
+        SIMPLECMD *cmd = &command->cmds[command->num_cmds];
+        uint32_t num_tokens = read_u32(data, &pos);
+        init_single_command(cmd, num_tokens);
+        for (uint32_t j = 0; j < num_tokens; j++) {
+            uint8_t tag = data[pos++];
+            uint32_t token_len = read_u32(data, &pos);
+            char *token = (char *) data + pos;
+            pos += token_len;
+            if (tag & SCRIPT_TOKEN_VARIABLE)
+                token = expand_variable(token);
+            if (add_token(cmd, tag & ~SCRIPT_TOKEN_VARIABLE, token) < 0)
+                failed = 1;
         }
+        // Skip empty stages
+        if (cmd->argc > 0)
+            command->num_cmds++;
+    }
+
+    if (failed) {
+        printf("Error: missing file name for redirection\n");
+        command->num_cmds = 0;
+        return pos;
+    }
+
+    strip_time_prefix(command);
+    return pos;
+
+}
+
+/******************************************************************************
+ * Functions for the event loop
+ *
+ * The shell blocks SIGINT and SIGQUIT and reads them from a signalfd, waits
+ * for children through pidfds, and waits for input on stdin, all from one
+ * epoll instance. Ctrl-C therefore never kills an interactive shell: at the
+ * prompt it discards the line, while a command runs it reaches the command.
+ *****************************************************************************/
+
+void init_event_loop(EVENTLOOP *loop, int handle_signals) {
 
-    if (local_vars->num_vars >= MAX_LOCAL_VARIABLES) {
-        printf("Error: too many local variables\n");
+    loop->signal_fd = -1;
+    loop->poll_stdin = 0;
+    sigprocmask(SIG_SETMASK, NULL, &loop->old_mask);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
         return;
+
+    if (handle_signals) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGQUIT);
+        sigprocmask(SIG_BLOCK, &mask, &loop->old_mask);
+
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_SIGNAL };
+        loop->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (loop->signal_fd >= 0 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->signal_fd, &event) < 0) {
+            close(loop->signal_fd);
+            loop->signal_fd = -1;
+        }
+        if (loop->signal_fd < 0)
+            sigprocmask(SIG_SETMASK, &loop->old_mask, NULL);
     }
 
-    local_vars->var_name[local_vars->num_vars] = strdup(name);
-    local_vars->var_value[local_vars->num_vars] = strdup(value);
-    local_vars->num_vars++;
+    // Regular files cannot be watched; getline() reads them directly
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_STDIN };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        loop->poll_stdin = 1;
+        // Input buffered inside stdio would be invisible to epoll
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
 
 }
 
-char* get_local_var(LOCALVARS *local_vars, const char *name) {
+void reopen_event_loop(EVENTLOOP *loop) {
+    // A forked worker that waits for its own children needs its own epoll
+    // instance, since the one it inherited is shared with the shell
 
-    for (int i = 0; i < local_vars->num_vars; i++)
-        if (strcmp(local_vars->var_name[i], name) == 0)
-            return strdup(local_vars->var_value[i]);
-    
-    // Return an empty string if the variable is not found
-    return NULL;
+    if (loop->epoll_fd < 0)
+        return;
+    close(loop->epoll_fd);
+    if (loop->signal_fd >= 0)
+        close(loop->signal_fd);
+    loop->signal_fd = -1;
+    loop->poll_stdin = 0;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 
 }
 
-void remove_local_var(LOCALVARS *local_vars, const char *name) {
+void reset_child_signals(EVENTLOOP *loop) {
+    // The signal mask survives exec, so give commands back the original one
+
+    sigprocmask(SIG_SETMASK, &loop->old_mask, NULL);
 
-    for (int i = 0; i < local_vars->num_vars; i++)
-        if (strcmp(local_vars->var_name[i], name) == 0) {
-            free(local_vars->var_name[i]);
-            free(local_vars->var_value[i]);
-            // Move all variables to the left
-            memmove(local_vars->var_name + i, local_vars->var_name + i + 1,
-                    (local_vars->num_vars - i - 1) * sizeof(char *));
-            memmove(local_vars->var_value + i, local_vars->var_value + i + 1,
-                    (local_vars->num_vars - i - 1) * sizeof(char *));
-            local_vars->num_vars--;
-            return;
-        }
-    // Variable not found
-    // printf("Error: variable not found, cannot delete\n");
-    return;
 }
 
-void display_local_vars(LOCALVARS *local_vars) {
+int open_pidfd(pid_t pid) {
 
-    for (int i = 0; i < local_vars->num_vars; i++)
-        printf("%s=%s\n", local_vars->var_name[i], local_vars->var_value[i]);
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
 
 }
 
-void free_local_vars(LOCALVARS *local_vars) {
+int forward_signals(EVENTLOOP *loop, pid_t *pids, int num_pids) {
+    // Drain the signalfd and pass each signal on to the running children.
+    // Return the number of signals read.
+
+    struct signalfd_siginfo info;
+    int count = 0;
 
-    for (int i = 0; i < local_vars->num_vars; i++) {
-        free(local_vars->var_name[i]);
-        free(local_vars->var_value[i]);
+    while (read(loop->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        count++;
+        // The terminal already delivered Ctrl-C and Ctrl-\ to the whole
+        // foreground process group, which the children share with the shell
+        if (info.ssi_code == SI_KERNEL)
+            continue;
+        for (int i = 0; i < num_pids; i++)
+            if (pids[i] > 0)
+                kill(pids[i], info.ssi_signo);
     }
-    free(local_vars->var_name);
-    free(local_vars->var_value);
-    local_vars->var_name = NULL;
-    local_vars->var_value = NULL;
-    local_vars->num_vars = 0;
-    // free(local_vars);
+    return count;
 
 }
 
-/******************************************************************************
- * Functions for parsing and checking
- *****************************************************************************/
-
-int parse_single_command(const char *cmd, char ***args) {
-    // Function to parse the input line into arguments
+void wait_children(EVENTLOOP *loop, pid_t *pids, int num_pids, struct rusage *usages, struct timespec *ends) {
+    // Reap every child in pids, in whatever order they exit, forwarding
+    // signals meanwhile. Children that could not be forked have pid <= 0,
+    // and each entry is cleared once its child has been reaped.
 
-    // args is a pointer to an array of strings
-    *args = malloc(MAX_ARGS * sizeof(char *));
-    int num_args = 0;
+    int pidfds[num_pids];                       // Watched pidfd of each child, -1 if none
+    int remaining = 0;                          // Children watched by epoll
 
-    char *token;
-    char *cmd_copy = strdup(cmd);
-    while ( (token = strsep(&cmd_copy, " \t\n")) != NULL ) {
-        // Copy the token to the argument array
-        if (strlen(token) > 0)
-            (*args)[num_args++] = strdup(token);
-        // Check to avoid exceeding MAX_ARGS
-        if (num_args >= MAX_ARGS) {
-            printf("Error: too many arguments\n");
-            break;
+    for (int i = 0; i < num_pids; i++) {
+        pidfds[i] = -1;
+        if (pids[i] <= 0 || loop->epoll_fd < 0)
+            continue;
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = i };
+        pidfds[i] = open_pidfd(pids[i]);
+        if (pidfds[i] >= 0 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, pidfds[i], &event) < 0) {
+            close(pidfds[i]);
+            pidfds[i] = -1;
         }
+        if (pidfds[i] >= 0)
+            remaining++;
     }
-    
-    // Replace local variables
-    for (int i = 0; i < num_args; i++) {
-        if ((*args)[i][0] == '$') {
-            char *var_name = (*args)[i] + 1;  // Skip the dollar sign
-            // Check for local variable
-            char *var_value = get_local_var(local_vars, var_name);
-            // environment variable has higher priority, replace if exists
-            if (getenv(var_name) != NULL)
-                var_value = strdup(getenv(var_name));
-            if (var_value == NULL) {
-                // Variable does not exist, so remove this argument from the array
-                free((*args)[i]);
-                for (int j = i; j < num_args - 1; j++)
-                    // Shift the remaining arguments one position to the left
-                    (*args)[j] = (*args)[j + 1];
-                (*args)[num_args - 1] = NULL;
-                num_args--;
-                i--;
+
+    while (remaining > 0) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u64 == EVENT_SIGNAL) {
+                forward_signals(loop, pids, num_pids);
                 continue;
             }
-            else {
-                free((*args)[i]);
-                // Replace the variable with its value regardless of whether it exists
-                (*args)[i] = var_value;
-            }
+            int i = (int) events[e].data.u64;
+            wait4(pids[i], NULL, 0, &usages[i]);
+            clock_gettime(CLOCK_MONOTONIC, &ends[i]);
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, pidfds[i], NULL);
+            close(pidfds[i]);
+            pidfds[i] = -1;
+            pids[i] = 0;
+            remaining--;
         }
     }
 
-    return num_args;
+    // Children without a pidfd, or left over if epoll failed, are reaped
+    // with blocking waits
+    for (int i = 0; i < num_pids; i++) {
+        if (pids[i] <= 0)
+            continue;
+        wait4(pids[i], NULL, 0, &usages[i]);
+        clock_gettime(CLOCK_MONOTONIC, &ends[i]);
+        if (pidfds[i] >= 0) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, pidfds[i], NULL);
+            close(pidfds[i]);
+        }
+        pids[i] = 0;
+    }
 
 }
 
-int parse_pipe_command(const char *cmd, char ***commands) {
-    // Parse a pipeline command into an array of commands
+int wait_for_input(EVENTLOOP *loop) {
+    // Wait until stdin has input. Return 0 if a signal arrived first; the
+    // terminal has then already discarded the partly typed line.
 
-    // commands is a pointer to an array of strings
-    *commands = malloc((MAX_ARGS + 1) * sizeof(char *));  // +1 for NULL-terminator
-    int num_commands = 0;
+    fflush(stdout);
+    if (!loop->poll_stdin)
+        return 1;
 
-    char *token;
-    char *cmd_copy = strdup(cmd);
-    while ( (token = strsep(&cmd_copy, "|")) != NULL ) {
-        // Copy the command to the commands array
-        if (strlen(token) > 0)
-            (*commands)[num_commands++] = strdup(token);
-        // Check to avoid exceeding MAX_ARGS
-        if (num_commands >= MAX_ARGS) {
-            printf("Error: too many pipeline commands\n");
-            break;
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_STDIN };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0)
+        return 1;
+
+    int ready = -1;
+    while (ready < 0) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ready = 1;
+        }
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u64 == EVENT_SIGNAL && forward_signals(loop, NULL, 0) > 0)
+                ready = 0;
+            else if (events[e].data.u64 == EVENT_STDIN && ready < 0)
+                ready = 1;
         }
     }
 
-    return num_commands;
+    // Only watch stdin at the prompt, so typing ahead does not wake up
+    // wait_children() while a command runs
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    return ready;
 
 }
 
-int check_pipe_command(char *cmd) {
-    // Return 1 if the command is a pipeline command, 0 otherwise
-
-    for (int i = 0; cmd[i] != '\0'; i++)
-        if (cmd[i] == '|')
-            return 1;
-
-    return 0;
-
-}
+int wait_for_fd(EVENTLOOP *loop, int fd, int timeout_ms) {
+    // Wait up to timeout_ms until fd is readable or at end of file. Return 1
+    // if it is, 0 on timeout and -1 if a signal arrived first.
 
-int check_builtin_command(char *arg0) {
-    // Return 1 if the command is a built-in command, 0 otherwise
+    if (loop->epoll_fd < 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int n;
+        while ( (n = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR )
+            ;
+        return n != 0 ? 1 : 0;
+    }
 
-    if (   strcmp(arg0, "exit")     == 0 
-        || strcmp(arg0, "cd")       == 0
-        || strcmp(arg0, "export")   == 0
-        || strcmp(arg0, "local")    == 0
-        || strcmp(arg0, "vars")     == 0
-        || strcmp(arg0, "history")  == 0
-    )
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_FD };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
         return 1;
 
-    return 0;
+    int ready = -2;
+    while (ready == -2) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ready = 1;
+        }
+        if (n == 0)
+            ready = 0;
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u64 == EVENT_SIGNAL && forward_signals(loop, NULL, 0) > 0)
+                ready = -1;
+            else if (events[e].data.u64 == EVENT_FD && ready == -2)
+                ready = 1;
+        }
+    }
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    return ready;
 
 }
 
@@ -376,11 +1950,60 @@ int check_builtin_command(char *arg0) {
  * Functions for execution
  *****************************************************************************/
 
-void execute_pipeline(char *pipecmd) {
+void execute_command(COMMAND *command) {
+    // Run a parsed, non-empty command line
+
+    SIMPLECMD *cmd = &command->cmds[0];
+    int timed = check_timed_command(command);
+
+    if (command->pipeline)
+        execute_pipeline(command);
+    else if (check_builtin_command(cmd->argv[0])) {
+        // Built-ins run in the shell, so their usage is the shell's own
+        struct timespec start, end;
+        struct rusage before, after;
+        if (timed) {
+            getrusage(RUSAGE_SELF, &before);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+
+        if (cmd->num_redirs == 0)
+            execute_builtin(cmd);
+        else {
+            // Built-ins run in the shell, so redirect around them and restore
+            fflush(stdout);
+            int saved_fds[3] = { dup(STDIN_FILENO), dup(STDOUT_FILENO), dup(STDERR_FILENO) };
+            if (apply_redirections(cmd) == 0) {
+                execute_builtin(cmd);
+                fflush(stdout);
+            }
+            for (int fd = 0; fd < 3; fd++) {
+                dup2(saved_fds[fd], fd);
+                close(saved_fds[fd]);
+            }
+        }
+
+        if (timed) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            getrusage(RUSAGE_SELF, &after);
+            timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+            timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+            after.ru_nvcsw -= before.ru_nvcsw;
+            after.ru_nivcsw -= before.ru_nivcsw;
+            report_usage(cmd->argv[0], elapsed_seconds(&start, &end), &after);
+        }
+    }
+    else
+        execute_single_command(cmd, timed);
+
+}
+
+void execute_pipeline(COMMAND *command) {
 
-    // Parse the command line into an array of commands
-    char **commands;
-    int num_commands = parse_pipe_command(pipecmd, &commands);
+    int num_commands = command->num_cmds;
+    int timed = check_timed_command(command);
+    pid_t pids[num_commands];                   // Process id of each stage
+    struct timespec starts[num_commands];       // Start time of each stage
 
     int pipe_fds[2 * (num_commands - 1)]; // Array to hold pipe file descriptors
     
@@ -394,10 +2017,14 @@ void execute_pipeline(char *pipecmd) {
     
     for (int i = 0; i < num_commands; i++) {
 
+        clock_gettime(CLOCK_MONOTONIC, &starts[i]);
         pid_t pid = fork();
+        pids[i] = pid;
 
         if (pid == 0) { // Child process
 
+            reset_child_signals(&event_loop);
+
             // Redirect input from the previous pipe, if not the first command
             if (i > 0) {
                 dup2(pipe_fds[(i - 1) * 2], STDIN_FILENO);
@@ -413,11 +2040,16 @@ void execute_pipeline(char *pipecmd) {
                 close(pipe_fds[j]);
             }
 
-            // Execute the command
-            char **args;
-            int argc = parse_single_command(commands[i], &args);
-            // NULL-terminate the arguments array
-            args[argc] = NULL;
+            // File redirections override the pipes
+            if (apply_redirections(&command->cmds[i]) < 0)
+                _exit(EXIT_FAILURE);
+
+            // Copy stages move the data without exec'ing cat
+            if (check_copy_command(&command->cmds[i]))
+                _exit(run_copy_command(&command->cmds[i]));
+
+            // Execute the command, the arguments are already NULL-terminated
+            char **args = command->cmds[i].argv;
 
             execvp(args[0], args);
 
@@ -439,23 +2071,36 @@ void execute_pipeline(char *pipecmd) {
         close(pipe_fds[i]);
     }
     
-    // Wait for all child processes to finish
-    for (int i = 0; i < num_commands; i++) {
-        wait(NULL);
+    // Wait for all child processes to finish, then report each stage with
+    // its own exit time so that the slowest stage stands out
+    struct rusage usages[num_commands];
+    struct timespec ends[num_commands];
+    wait_children(&event_loop, pids, num_commands, usages, ends);
+    for (int i = 0; timed && i < num_commands; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "stage %d (%s)", i + 1, command->cmds[i].argv[0]);
+        report_usage(name, elapsed_seconds(&starts[i], &ends[i]), &usages[i]);
+    }
+
+    if (timed) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "pipeline: real %.3fs\n", elapsed_seconds(&starts[0], &end));
     }
 
 }
 
-void execute_builtin(char *cmd) {
+void execute_builtin(SIMPLECMD *cmd) {
 
-    char **args;
-    // Parse the input command
-    int argc = parse_single_command(cmd, &args);
+    char **args = cmd->argv;
+    int argc = cmd->argc;
 
     // Exit
     if (strcmp(args[0], "exit") == 0) {
         free_history(history);
         free_local_vars(local_vars);
+        free_coprocs(coprocs);
+        free_arena(arena);
         exit(EXIT_SUCCESS);
     }
 
@@ -547,14 +2192,10 @@ void execute_builtin(char *cmd) {
             get_history(history, index, &cmd);
             // Execute the command from history
             if (cmd != NULL) {
-                char **args;
-                parse_single_command(cmd, &args);
-                if (check_pipe_command(cmd))
-                    execute_pipeline(cmd);
-                else if (check_builtin_command(args[0]))
-                    execute_builtin(cmd);
-                else
-                    execute_single_command(cmd);
+                // Parse again so that variables get their current values
+                COMMAND replay;
+                if (parse_command_line(cmd, &replay) > 0)
+                    execute_command(&replay);
                 free(cmd);
             }
             else
@@ -573,6 +2214,21 @@ void execute_builtin(char *cmd) {
         else
             printf("history usage error\n");
     }
+
+    // coproc
+    else if (strcmp(args[0], "coproc") == 0) {
+        if (argc == 1 || (argc == 2 && strcmp(args[1], "list") == 0))
+            display_coprocs(coprocs);
+        else if (argc >= 4 && strcmp(args[1], "start") == 0)
+            start_coproc(coprocs, args[2], args + 3);
+        else if (argc >= 3 && strcmp(args[1], "send") == 0)
+            send_coproc(coprocs, args[2], args + 3, argc - 3);
+        else if (argc == 3 && strcmp(args[1], "stop") == 0)
+            stop_coproc(coprocs, args[2]);
+        else
+            printf("Usage: coproc [list | start <name> <command> | send <name> <request> | stop <name>]\n");
+        return;
+    }
     else
         // This should not happen, as we have already checked for built-in commands
         printf("Error: not a built-in command\n");
@@ -581,29 +2237,38 @@ void execute_builtin(char *cmd) {
 
 }
 
-void execute_single_command(char *cmd) {
 
-    char **args;
-    // Parse the input command
-    int argc = parse_single_command(cmd, &args);
+void execute_single_command(SIMPLECMD *cmd, int timed) {
 
-    // NULL-terminate the arguments array
-    args[argc] = NULL;
+    // The arguments are already NULL-terminated
+    char **args = cmd->argv;
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     pid_t pid = fork();
 
     if (pid == 0) {
         // Child process
+        reset_child_signals(&event_loop);
+        if (apply_redirections(cmd) < 0)
+            _exit(EXIT_FAILURE);
+        if (check_copy_command(cmd))
+            _exit(run_copy_command(cmd));
         if (execvp(args[0], args) == -1) {
             printf("execvp: No such file or directory\n");
+            // stdout is fully buffered when a batch worker captures it
+            fflush(stdout);
             _exit(EXIT_FAILURE);  // Fixed bugs here: use _exit() to kill the child process
             // Otherwise, wsh will need 2 exit calls to terminate.
         }
     }
     else if (pid > 0) {
         // Parent process
-        int status;
-        waitpid(pid, &status, 0);
+        struct rusage usage;
+        struct timespec end;
+        wait_children(&event_loop, &pid, 1, &usage, &end);
+        if (timed)
+            report_usage(args[0], elapsed_seconds(&start, &end), &usage);
     }
     else {
         // Fork failed
@@ -616,40 +2281,30 @@ void interactive_mode() {
 
     char *cmd = NULL;
     size_t len = 0;
-    char **args;
-    int argc;
+    COMMAND command;
 
     printf(PROMPT);
 
-    while ( getline(&cmd, &len, stdin) > 0 ) {
-
-        // Check for pipeline command
-        if (check_pipe_command(cmd)) {
-            execute_pipeline(cmd);
-            // Add non built-in commands to history
-            add_history(history, cmd);
-            printf(PROMPT);
-            continue;
-        }
+    while (1) {
 
-        // Parse the input command
-        argc = parse_single_command(cmd, &args);
-        // Skip empty command
-        if (argc == 0) {
-            printf(PROMPT);
+        // Ctrl-C at the prompt starts a fresh line instead of exiting
+        if (!wait_for_input(&event_loop)) {
+            printf("\n" PROMPT);
             continue;
         }
+        if (getline(&cmd, &len, stdin) <= 0)
+            break;
 
-        // Check for built-in commands
-        if (check_builtin_command(args[0])) {
-            execute_builtin(cmd);
-            printf(PROMPT);
-            continue;
+        // Parse the input command once; skip empty command
+        if (parse_command_line(cmd, &command) > 0) {
+            execute_command(&command);
+            // Add non built-in commands to history
+            if (check_history_command(&command))
+                add_history(history, command.line);
         }
 
-        execute_single_command(cmd);
-        // Add non built-in commands to history
-        add_history(history, cmd);
+        // Release everything parsed from this line
+        reset_arena(arena);
         printf(PROMPT);
 
     }
@@ -658,6 +2313,8 @@ void interactive_mode() {
     free(cmd);
     free_history(history);
     free_local_vars(local_vars);
+    free_coprocs(coprocs);
+    free_arena(arena);
     exit(EXIT_SUCCESS);
 
 }
@@ -672,43 +2329,156 @@ void batch_mode(char *batch_file) {
 
     char *cmd = NULL;
     size_t len = 0;
-    char **args;
-    int argc;
+    COMMAND command;
 
     while ( getline(&cmd, &len, file) > 0 ) {
 
-        // Check for pipeline command
-        if (check_pipe_command(cmd)) {
-            execute_pipeline(cmd);
+        // Parse the input command once; skip empty command
+        if (parse_command_line(cmd, &command) > 0) {
+            execute_command(&command);
             // Add non built-in commands to history
-            add_history(history, cmd);
-            continue;
+            if (check_history_command(&command))
+                add_history(history, command.line);
         }
 
-        // Parse the input command
-        argc = parse_single_command(cmd, &args);
-        // Skip empty command
-        if (argc == 0) {
-            continue;
+        // Release everything parsed from this line
+        reset_arena(arena);
+
+    }
+
+    // Exit on EOF
+    free(cmd);
+    free_history(history);
+    free_local_vars(local_vars);
+    free_coprocs(coprocs);
+    free_arena(arena);
+    fclose(file);
+    exit(EXIT_SUCCESS);
+
+}
+
+void parallel_batch_mode(char *batch_file, int max_jobs) {
+    // Like batch_mode, but consecutive external commands run concurrently on
+    // up to max_jobs workers. A "wait" line or any built-in command is a barrier:
+    // all earlier commands finish before it runs. A line prefixed with "@tag "
+    // runs only after the previous line with the same tag has finished. The
+    // output of each command is printed in script order. Queued jobs live in
+    // the arena, so it is reset after each barrier instead of after each line.
+
+    FILE *file = fopen(batch_file, "r");
+    if (!file) {
+        printf("Error: cannot open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    BATCHGROUP group = { NULL, 0, 0 };
+    char *cmd = NULL;
+    size_t len = 0;
+    COMMAND command;
+
+    while ( getline(&cmd, &len, file) > 0 ) {
+
+        // Split off the dependency tag, if any
+        char *line = cmd;
+        char *tag = NULL;
+        if (line[0] == BATCH_TAG_PREFIX) {
+            tag = strsep(&line, " \t\n") + 1;
+            if (line == NULL)
+                continue;
         }
 
-        // Check for built-in commands
-        if (check_builtin_command(args[0])) {
-            execute_builtin(cmd);
+        // Parse the input command once; skip empty command
+        if (parse_command_line(line, &command) == 0)
             continue;
+
+        if (!command.pipeline) {
+            char *arg0 = command.cmds[0].argv[0];
+
+            // Barrier: finish the running group
+            if (command.cmds[0].argc == 1 && strcmp(arg0, BATCH_BARRIER) == 0) {
+                run_batch_group(&group, max_jobs);
+                reset_arena(arena);
+                continue;
+            }
+
+            // Built-in commands change shell state, so they are barriers too
+            if (check_builtin_command(arg0)) {
+                run_batch_group(&group, max_jobs);
+                execute_command(&command);
+                reset_arena(arena);
+                continue;
+            }
         }
 
-        execute_single_command(cmd);
+        add_batch_job(&group, &command, tag);
         // Add non built-in commands to history
-        add_history(history, cmd);
+        add_history(history, command.line);
 
     }
 
     // Exit on EOF
+    run_batch_group(&group, max_jobs);
+    free(group.jobs);
     free(cmd);
     free_history(history);
     free_local_vars(local_vars);
+    free_coprocs(coprocs);
+    free_arena(arena);
     fclose(file);
     exit(EXIT_SUCCESS);
 
 }
+
+void cached_batch_mode(char *batch_file) {
+    // Like batch_mode, but run the compiled lines from the script cache and
+    // only compile the batch file when the cache is missing or stale
+
+    struct stat st;
+    if (stat(batch_file, &st) != 0) {
+        printf("Error: cannot open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char cache_file[strlen(batch_file) + sizeof(SCRIPT_CACHE_SUFFIX)];
+    sprintf(cache_file, "%s%s", batch_file, SCRIPT_CACHE_SUFFIX);
+
+    BYTEBUF body = { NULL, 0, 0 };
+    if (load_script_cache(cache_file, batch_file, &st, &body) != 0) {
+        size_t size;
+        char *source = read_whole_file(batch_file, &size);
+        if (source == NULL) {
+            printf("Error: cannot open file\n");
+            exit(EXIT_FAILURE);
+        }
+        compile_script(source, size, &body);
+        save_script_cache(cache_file, &st, hash_bytes(source, size), &body);
+        free(source);
+    }
+
+    COMMAND command;
+    size_t pos = 0;
+
+    while (pos < body.size) {
+
+        pos = load_compiled_line(body.data, pos, &command);
+        if (command.num_cmds > 0) {
+            execute_command(&command);
+            // Add non built-in commands to history
+            if (check_history_command(&command))
+                add_history(history, command.line);
+        }
+
+        // Release everything built from this line
+        reset_arena(arena);
+
+    }
+
+    // Exit on EOF
+    free(body.data);
+    free_history(history);
+    free_local_vars(local_vars);
+    free_coprocs(coprocs);
+    free_arena(arena);
+    exit(EXIT_SUCCESS);
+
+}
\ No newline at end of file
@@ -0,0 +1,2 @@
+# Count the zombie children of wsh, the parent of this job's worker
+ps -o stat= --ppid $(ps -o ppid= -p $PPID) | grep -c "^Z"